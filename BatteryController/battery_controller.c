@@ -5,6 +5,7 @@
 #include "dev/leds.h"
 #include "dev/button-hal.h"
 #include "sys/etimer.h"
+#include "sys/energest.h"
 #include "sys/log.h"
 #include "net/ipv6/uip.h"
 #include "net/ipv6/uip-ds6.h"
@@ -21,6 +22,10 @@
 #include "../includes/utility.h"
 #include "../includes/constants.h"
 #include "../includes/battery_soh_model.h"
+#include "../includes/battery_physics.h"
+#include "../includes/coap_stats.h"
+#include "../includes/diag_log.h"
+#include "../includes/trace.h"
 #include "project-conf.h"
 
 #define LOG_MODULE "BatCtrl"
@@ -28,13 +33,17 @@
 
 // utility functions
 float get_random_noise(float magnitude) {
+#if BATTERY_PHYS_CONF_FIXED
+    // no float divide: draw in [-50, 49] scaled by a folded constant
+    return (float)((int)(random_rand() % 100) - 50) * (magnitude * (1.0f / 50.0f));
+#else
     return ((random_rand() % 100) / 50.0f - 1.0f) * magnitude;
+#endif
 }
 
 
 // scaling configuration and current battery state
 #define POWER_SCALE_FACTOR 1000.0f  /* Scale factor: 1kW per unit power */
-#define SCALED_CAPACITY_AH 200.0f   /* Scaled capacity: 200Ah (100x cells in parallel) */
 battery_state_t current_state = STATE_INIT;
 float bat_voltage = 3.7f;
 float bat_current = 0.0f;
@@ -65,11 +74,43 @@ uint8_t was_charging = false;        /* Per contare cicli */
 // coap resource declaration
 extern coap_resource_t
     res_dev_state, 
-    res_dev_power;
-
-// timer definition
-struct etimer et_loop, et_init_wait, et_notify;
-struct ctimer ct_led_blink;
+    res_dev_power,
+    res_dev_stats,
+    res_dev_diag;
+
+// timer definition: one periodic wakeup drives every periodic task
+struct etimer et_loop, et_init_wait;
+
+// trace spans (native builds with TRACE=1, see includes/trace.h)
+static trace_ts_t span_physics, span_infer, span_notify;
+
+/*
+ * Coalesced scheduler: physics, safety, notification and LED work run in
+ * the same wakeup, once per SCHED_PERIOD. Tasks are selected by state, so a
+ * state with nothing to do (e.g. LED blinking while RUNNING) costs no timer.
+ */
+#define SCHED_PERIOD        (CLOCK_SECOND * 5)
+// physics advances dt = 1 s per step: one step per second of the period
+#define PHYS_SUBSTEPS       (SCHED_PERIOD / CLOCK_SECOND)
+#define REG_RETRY_MIN       (CLOCK_SECOND * 1)
+#define REG_RETRY_MAX       SCHED_PERIOD
+#define STATUS_EVERY_TICKS  10
+
+#define TASK_PHYSICS  0x01
+#define TASK_SAFETY   0x02
+#define TASK_NOTIFY   0x04
+#define TASK_LED      0x08
+
+static uint8_t sched_due_tasks(void) {
+    switch(current_state) {
+    case STATE_RUNNING:
+        return TASK_PHYSICS | TASK_SAFETY | TASK_NOTIFY;
+    case STATE_ISOLATED:
+        return TASK_NOTIFY | TASK_LED;
+    default:
+        return TASK_LED;
+    }
+}
 
 // utility functions
 static void print_battery_status(void) {
@@ -83,16 +124,35 @@ static void print_battery_status(void) {
            (int)(bat_soh*100.0f) / 100,(int)(bat_soh*100.0f) % 100);
 }
 
-void led_blink(void * pt) {
+// blink step, executed on the shared wakeup (INIT retries / ISOLATED ticks)
+static void led_blink(void) {
     if (current_state == STATE_INIT) {
         leds_toggle(LEDS_YELLOW);
-        ctimer_reset(&ct_led_blink);
     } else if (current_state == STATE_ISOLATED) {
         leds_toggle(LEDS_RED);
-        ctimer_reset(&ct_led_blink);
     }
 }
 
+// LPM residency over the last reporting window, in tenths of percent
+static void report_energest(void) {
+    static uint64_t last_total = 0, last_lpm = 0;
+
+    energest_flush();
+    uint64_t total = ENERGEST_GET_TOTAL_TIME();
+    uint64_t lpm = energest_type_time(ENERGEST_TYPE_LPM) +
+                   energest_type_time(ENERGEST_TYPE_DEEP_LPM);
+
+    uint64_t d_total = total - last_total;
+    uint64_t d_lpm = lpm - last_lpm;
+    last_total = total;
+    last_lpm = lpm;
+
+    if (d_total == 0) return;
+    uint32_t permil = (uint32_t)((d_lpm * 1000) / d_total);
+    LOG_INFO("[ENERGEST] LPM residency: %lu.%lu%%\n",
+             (unsigned long)(permil / 10), (unsigned long)(permil % 10));
+}
+
 
 void update_leds() {
     leds_off(~0);
@@ -107,209 +167,108 @@ void update_leds() {
     }
 }
 
+static void diag_sample(uint32_t t);
+
+// one dt = 1 s physics step at the current (derated) setpoint
+static void physics_substep(void) {
+    // same draw order as before the kernel was extracted
+    float noise[PHYS_NOISE_COUNT];
+    for (int k = 0; k < PHYS_NOISE_COUNT; k++) {
+        noise[k] = get_random_noise(1.0f);
+    }
+
+    battery_phys_t b = {
+        bat_voltage, bat_current, bat_temp, bat_soc, bat_soh, bat_capacity_ah,
+        charge_cycles, total_ah_throughput, peak_temp_reached, was_charging
+    };
+    battery_physics_step(&b, power_setpoint, noise);
+
+    bat_voltage = b.voltage;
+    bat_current = b.current;
+    bat_temp = b.temp;
+    bat_soc = b.soc;
+    bat_soh = b.soh;
+    bat_capacity_ah = b.capacity_ah;
+    charge_cycles = b.charge_cycles;
+    total_ah_throughput = b.total_ah_throughput;
+    peak_temp_reached = b.peak_temp;
+    was_charging = b.was_charging;
+}
+
+/*
+ * Physics catches up with the wall clock on each wakeup: PHYS_SUBSTEPS steps
+ * of 1 s, each logged to the diagnostic ring at its own second (1 Hz). The
+ * last step is logged by the caller after the safety check, so the record
+ * carries the state it leads to.
+ */
 static void update_sensors_and_buffer() {
     if (current_state == STATE_RUNNING) {
-        /* Parametri fisici della batteria Li-ion SCALATA (Pacco Domestico 13.5kWh) */
-        const float BATTERY_CAPACITY_AH = SCALED_CAPACITY_AH;  /* Capacità scalata: 200Ah */
-        const float NOMINAL_VOLTAGE = 3.7f;                     /* Tensione nominale [V] - manteniamo bassa per ML */
-        const float V_MIN = 3.0f;                               /* Tensione minima scarica [V] */
-        const float V_MAX = 4.2f;                               /* Tensione massima carica [V] */
-        const float INTERNAL_RESISTANCE = 0.0008f;              /* Resistenza interna [Ω] - scalata (0.08/100) */
-        const float THERMAL_MASS = 5000.0f;                     /* Massa termica scalata [J/°C] - pacco grande */
-        const float HEAT_DISSIPATION = 200.0f;                  /* Coefficiente dissipazione [W/°C] - scalato */
-        const float AMBIENT_TEMP = 25.0f;                       /* Temperatura ambiente [°C] */
-        const float EFFICIENCY = 0.92f;                         /* Efficienza conversione - più realistica */
-        
-        /* Timestep di aggiornamento (1 secondo) */
-        const float dt = 1.0f; /* [s] */
-
-        /*
-         * 0. LEGA LA POTENZA EROGABILE ALLO STATE OF CHARGE
-         */
-        const float SOC_EMPTY_CUTOFF      = 0.02f;  /* sotto 2% vietata scarica */
-        const float SOC_DERATE_DISCHARGE  = 0.10f;  /* sotto 10% scarica deratata */
-        const float SOC_FULL_CUTOFF       = 0.98f;  /* sopra 98% vietata carica */
-        const float SOC_DERATE_CHARGE     = 0.90f;  /* sopra 90% carica deratata */
-
-        float effective_power = power_setpoint;
-
-        int32_t soc_permil = (int32_t)(bat_soc * 1000.0f);
-        int32_t soc_pct_tenths = soc_permil;
-        int32_t soc_pct_int = soc_pct_tenths / 10;
-        int32_t soc_pct_dec = (soc_pct_tenths >= 0 ? soc_pct_tenths : -soc_pct_tenths) % 10;
-
-        /* Comando di SCARICA (potenza negativa) */
-        if (effective_power < -0.5f) {
-            if (bat_soc <= SOC_EMPTY_CUTOFF) {
-                effective_power = 0.0f;
-            } else if (bat_soc < SOC_DERATE_DISCHARGE) {
-                float scale = (bat_soc - SOC_EMPTY_CUTOFF) /
-                              (SOC_DERATE_DISCHARGE - SOC_EMPTY_CUTOFF);
-                if (scale < 0.0f) scale = 0.0f;
-                effective_power *= scale;
-            }
-        }
+        float effective_power = battery_derate_power(bat_soc, power_setpoint);
 
-        /* Comando di CARICA (potenza positiva) */
-        if(effective_power > 0.5f) {
-            if(bat_soc >= SOC_FULL_CUTOFF) {
+        if (power_setpoint > 0.5f && effective_power != power_setpoint) {
+            int32_t soc_permil = (int32_t)(bat_soc * 1000.0f);
+            int32_t soc_pct_int = soc_permil / 10;
+            int32_t soc_pct_dec = (soc_permil >= 0 ? soc_permil : -soc_permil) % 10;
+
+            if (effective_power == 0.0f) {
                 LOG_WARN("[LIMIT] SoC=%ld.%01ld%% -> carica vietata, forzo 0W\n",
                          (long)soc_pct_int, (long)soc_pct_dec);
-                effective_power = 0.0f;
-            } else if(bat_soc > SOC_DERATE_CHARGE) {
-                float scale = (SOC_FULL_CUTOFF - bat_soc) /
-                              (SOC_FULL_CUTOFF - SOC_DERATE_CHARGE);
-                if(scale < 0.0f) scale = 0.0f;
-                float old = effective_power;
-                effective_power *= scale;
-
-                int32_t old_w = (int32_t)(old);
-                int32_t new_w = (int32_t)(effective_power);
-
+            } else {
                 LOG_INFO("[LIMIT] SoC=%ld.%01ld%% -> derating carica: %ldW -> %ldW\n",
                          (long)soc_pct_int, (long)soc_pct_dec,
-                         (long)old_w, (long)new_w);
+                         (long)(int32_t)power_setpoint, (long)(int32_t)effective_power);
             }
         }
 
         power_setpoint = effective_power;
-        
-        /* 1. CALCOLA CORRENTE dalla potenza richiesta */
-        float ocv = V_MIN + (V_MAX - V_MIN) * bat_soc;
-        float requested_current = (ocv > 0.1f) ? (power_setpoint / ocv) : 0.0f;
-        float current_noise = get_random_noise(0.02f * fabs(requested_current));
-        bat_current = requested_current + current_noise;
-        
-        /* Limita corrente in base a C-rate */
-        float max_current = BATTERY_CAPACITY_AH * 15.0f;
-        if(bat_current > max_current) bat_current = max_current;
-        if(bat_current < -max_current) bat_current = -max_current;
-        
-        /* 2. AGGIORNA TENSIONE */
-        bat_voltage = ocv - (bat_current * INTERNAL_RESISTANCE);
-        
-        if(bat_soc < 0.1f) {
-            bat_voltage -= (0.1f - bat_soc) * 2.0f;
-        }
-        if(bat_soc > 0.9f) {
-            bat_voltage += (bat_soc - 0.9f) * 0.5f;
-        }
-        
-        if(bat_voltage > V_MAX) bat_voltage = V_MAX;
-        if(bat_voltage < V_MIN) bat_voltage = V_MIN;
-        bat_voltage += get_random_noise(0.01f);
-        
-        /* 3. AGGIORNA STATE OF CHARGE */
-        float efficiency = (bat_current > 0) ? EFFICIENCY : (1.0f / EFFICIENCY);
-        float energy_joules = power_setpoint * efficiency * dt;
-        float current_capacity_ah = BATTERY_CAPACITY_AH * bat_soh;
-        float capacity_joules = current_capacity_ah * NOMINAL_VOLTAGE * 3600.0f;
-        float delta_soc = energy_joules / capacity_joules;
-        bat_soc += delta_soc;
-        
-        float ah_transferred = fabs(bat_current) * (dt / 3600.0f);
-        total_ah_throughput += ah_transferred;
-        
-        bool is_charging = (bat_current > 0.5f);
-        if(is_charging && !was_charging && bat_soc < 0.5f) {
-            charge_cycles++;
-        }
-        was_charging = is_charging;
-        
-        if(bat_soc > 1.0f) bat_soc = 1.0f;
-        if(bat_soc < 0.0f) bat_soc = 0.0f;
-        
-        /* 4. AGGIORNA TEMPERATURA */
-        float power_loss = bat_current * bat_current * INTERNAL_RESISTANCE;
-        float heat_generated = power_loss * dt;
-        float heat_dissipated = HEAT_DISSIPATION * (bat_temp - AMBIENT_TEMP) * dt;
-        float delta_temp = (heat_generated - heat_dissipated) / THERMAL_MASS;
-        bat_temp += delta_temp;
-        bat_temp += get_random_noise(0.5f);
-        
-        if(bat_temp > peak_temp_reached) {
-            peak_temp_reached = bat_temp;
-        }
-        
-        if(bat_temp < 0.0f) bat_temp = 0.0f;
-        if(bat_temp > 80.0f) bat_temp = 80.0f;
-        
-        /* 5. AGGIORNA CAPACITÀ (SoH) */
-        float cycle_degradation = charge_cycles * 0.0008f;
-        float throughput_degradation = total_ah_throughput * 0.00005f;
-        
-        float temp_degradation = 0.0f;
-        if(bat_temp > 40.0f) {
-            temp_degradation = (bat_temp - 40.0f) * 0.0001f;
-        }
-        if(bat_temp > 55.0f) {
-            temp_degradation += (bat_temp - 55.0f) * 0.0005f;
-        }
-        
-        float soc_stress_degradation = 0.0f;
-        if(bat_soc < 0.15f) {
-            soc_stress_degradation = (0.15f - bat_soc) * 0.0002f;
-        }
-        if(bat_soc > 0.95f) {
-            soc_stress_degradation = (bat_soc - 0.95f) * 0.0001f;
-        }
-        
-        float c_rate = fabs(bat_current) / BATTERY_CAPACITY_AH;
-        float c_rate_degradation = 0.0f;
-        if(c_rate > 3.0f) {
-            c_rate_degradation = (c_rate - 3.0f) * 0.00003f;
+
+        uint32_t now = (uint32_t)clock_seconds();
+        for (int k = 0; k < PHYS_SUBSTEPS; k++) {
+            if (k > 0) {
+                // SoC moves within the period: keep the cutoffs honoured
+                power_setpoint = battery_derate_power(bat_soc, power_setpoint);
+            }
+            physics_substep();
+            if (k < PHYS_SUBSTEPS - 1) {
+                diag_sample(now - (uint32_t)(PHYS_SUBSTEPS - 1 - k));
+            }
         }
-        
-        float total_degradation = cycle_degradation + throughput_degradation + 
-                                 temp_degradation + soc_stress_degradation + 
-                                 c_rate_degradation;
-        
-        bat_soh -= total_degradation * dt;
-        
-        if(bat_soh > 1.0f) bat_soh = 1.0f;
-        if(bat_soh < 0.5f) bat_soh = 0.5f;
-        
-        bat_capacity_ah = BATTERY_CAPACITY_AH * bat_soh;
     }
 
     /* Aggiorna buffer ML (ancora float) */
-    for(int i=0; i<(ML_WINDOW-1)*N_FEATURES; i++) {
-        ml_buffer[i] = ml_buffer[i+N_FEATURES];
-    }
-    int idx = (ML_WINDOW-1)*N_FEATURES;
-    ml_buffer[idx] = bat_voltage / 4.2f;
-    ml_buffer[idx+1] = ((bat_current + 10.0f) / 20.0f);
-    ml_buffer[idx+2] = bat_temp / 80.0f;
-    ml_buffer[idx+3] = bat_soc;
+    battery_phys_t snap = { .voltage = bat_voltage, .current = bat_current,
+                            .temp = bat_temp, .soc = bat_soc };
+    battery_push_features(&snap, ml_buffer);
+}
+
+// packs the current physics state into the diagnostic ring, t in clock_seconds()
+static void diag_sample(uint32_t t) {
+    diag_record_t rec;
+    rec.t = t;
+    rec.v_mv = (uint16_t)lroundf(bat_voltage * 1000.0f);
+    rec.i_da = (int16_t)lroundf(bat_current * 10.0f);
+    rec.t_dc = (int16_t)lroundf(bat_temp * 10.0f);
+    rec.soc = (uint16_t)lroundf(bat_soc * 10000.0f);
+    rec.soh = (uint16_t)lroundf(bat_soh * 10000.0f);
+    rec.sp_dw = (int16_t)lroundf(power_setpoint / 10.0f);
+    rec.state = (uint8_t)current_state;
+    diag_log_append(&rec);
+}
+
+static void notify_state(void) {
+    TRACE_BEGIN(span_notify);
+    coap_stats_notify(&res_dev_state);
+    TRACE_END(span_notify, "notify");
 }
 
 static void check_safety() {
 
+    TRACE_BEGIN(span_infer);
     battery_soh_regress(ml_buffer, ML_WINDOW*N_FEATURES, output, 1);
+    TRACE_END(span_infer, "inference");
 
-    // clamp output to acceptable values
-    output[0] = output[0] < 0 ? 0 : output[0];
-    output[0] = output[0] > 100 ? 100 : output[0];
-
-    float ml_soh = output[0] / 100.0f;  // 0..1
-    float combined_soh = (ml_soh*0.7f) + (bat_soh*0.3f);
-    
-    // thermal effect
-    if(bat_temp > 45.0f) {
-        combined_soh -= (bat_temp - 45.0f) * 0.001f;
-    }
-    
-    // low state of charge effect
-    if(bat_soc < 0.1f) {
-        combined_soh -= (0.1f - bat_soc) * 0.02f;
-    }
-    
-    // to high or too low combined soh
-    if(combined_soh > 1.0f) combined_soh = 1.0f;
-    if(combined_soh < 0.5f) combined_soh = 0.5f;
-    
-    // final battery soh and capacity updated
-    bat_soh = (bat_soh * 0.95f) + (combined_soh * 0.05f);
+    // ML estimate blended into the model SoH
+    bat_soh = battery_soh_blend(bat_soh, bat_temp, bat_soc, output[0]);
     bat_capacity_ah = SCALED_CAPACITY_AH * bat_soh;
 
     int32_t soh_permil = (int32_t)(bat_soh * 1000.0f);
@@ -347,9 +306,7 @@ static void check_safety() {
         current_state = STATE_ISOLATED;
         power_setpoint = 0.0f;
         bat_current = 0.0f;
-        coap_notify_observers(&res_dev_state);
-        
-        ctimer_reset(&ct_led_blink);
+        notify_state();
 
         leds_off(LEDS_ALL);
         leds_toggle(LEDS_RED);
@@ -381,6 +338,7 @@ static void check_safety() {
 // registration callback
 static void reg_callback(coap_message_t *response) {
 
+    coap_stats_response(response);
     if(response) {
         LOG_INFO("[INIT] Registration ACK received");
         if(response->code == CREATED_2_01 || response->code == CHANGED_2_04) {
@@ -403,6 +361,8 @@ PROCESS_THREAD(battery_controller, ev, data) {
     static coap_endpoint_t server_ep;
     static coap_message_t request[1];
     static int retry_count = 0;
+    static clock_time_t retry_wait = REG_RETRY_MIN;
+    static uint8_t status_counter = 0;
     
     PROCESS_BEGIN();
     
@@ -410,18 +370,15 @@ PROCESS_THREAD(battery_controller, ev, data) {
     // avoid errors with emlearn
     printf("%p\n", eml_error_str);
     printf("%p\n", eml_net_activation_function_strs);
+    TRACE_INIT("Battery");
     
 
-    // start timer
-    ctimer_set(
-            &ct_led_blink,
-            CLOCK_SECOND,
-            led_blink,
-            NULL);
-
     // activate coap resources
     coap_activate_resource(&res_dev_state, "dev/state");
     coap_activate_resource(&res_dev_power, "dev/power");
+    coap_activate_resource(&res_dev_stats, "dev/stats");
+    coap_activate_resource(&res_dev_diag, "dev/diag");
+    diag_log_init();
     LOG_INFO("[INIT] CoAP resources activated (dev/state is OBSERVABLE)\n");
 
     // registate to CoAP endpoint
@@ -429,16 +386,21 @@ PROCESS_THREAD(battery_controller, ev, data) {
     LOG_INFO("[INIT] Target endpoint: %s\n", UGRID_EP);
     
 
-    // registration phase 
+    // registration phase: LEDs cleared once, then the INIT blink only toggles
+    update_leds();
     while(current_state == STATE_INIT) {
 
         LOG_INFO("[INIT] Registration attempt #%d\n", retry_count++);
         
+        // retries back off up to the scheduler period, the INIT blink
+        // rides on the same wakeup instead of a dedicated 1 s timer
         if (retry_count > 0) {
-            etimer_set(&et_init_wait, CLOCK_SECOND * 1);
+            etimer_set(&et_init_wait, retry_wait);
             PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et_init_wait));
+            if (retry_wait < REG_RETRY_MAX) retry_wait *= 2;
+            if (retry_wait > REG_RETRY_MAX) retry_wait = REG_RETRY_MAX;
         }
-        update_leds();
+        led_blink();
     
         // build request
         coap_endpoint_parse(UGRID_EP, strlen(UGRID_EP), &server_ep);
@@ -450,6 +412,7 @@ PROCESS_THREAD(battery_controller, ev, data) {
         coap_set_payload(request, (uint8_t*)payload, strlen(payload));
 
         // send request
+        coap_stats.req_sent++;
         COAP_BLOCKING_REQUEST(&server_ep, request, reg_callback);
         
         if(current_state == STATE_RUNNING) {
@@ -458,30 +421,44 @@ PROCESS_THREAD(battery_controller, ev, data) {
         }
     }
 
-    // notify state 
-    etimer_set(&et_loop, CLOCK_SECOND * 5);
+    // single periodic wakeup for every task
+    etimer_set(&et_loop, SCHED_PERIOD);
     
     while(1) {
         PROCESS_WAIT_EVENT();
         
         if(ev == PROCESS_EVENT_TIMER && data == &et_loop) {
-            if(current_state != STATE_ISOLATED) {
+            uint8_t due = sched_due_tasks();
+
+            if(due & TASK_PHYSICS) {
+                TRACE_BEGIN(span_physics);
                 update_sensors_and_buffer();
+                TRACE_END(span_physics, "physics");
             }
-            
-            if(current_state == STATE_RUNNING) { 
+            if(due & TASK_SAFETY) {
                 check_safety();
-                
-                static int status_counter = 0;
-                if(++status_counter >= 10) {
+            }
+            // record of the last physics step, including the isolating one
+            if(due & TASK_PHYSICS) {
+                diag_sample((uint32_t)clock_seconds());
+            }
+            // notify uGridController (state may have just become ISOLATED)
+            if(due & TASK_NOTIFY) {
+                notify_state();
+            }
+            if(due & TASK_LED) {
+                led_blink();
+            }
+
+            if(++status_counter >= STATUS_EVERY_TICKS) {
+                if(current_state == STATE_RUNNING) {
                     print_battery_status();
-                    status_counter = 0;
                 }
+                report_energest();
+                status_counter = 0;
             }
-            
-            // notify uGridController
-            coap_notify_observers(&res_dev_state);
 
+            TRACE_FLUSH();
             etimer_reset(&et_loop);
         }
         
@@ -0,0 +1,80 @@
+#include "contiki.h"
+#include "cfs/cfs.h"
+#ifndef CONTIKI_TARGET_NATIVE
+#include "cfs/cfs-coffee.h"
+#endif
+#include "sys/log.h"
+#include "../includes/diag_log.h"
+
+#define LOG_MODULE "diag"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+/*
+ * Ring layout: DIAG_LOG_RECORDS slots of DIAG_RECORD_SIZE bytes in a single
+ * CFS file, kept open for the node lifetime. Head and count live in RAM; the
+ * file is recreated at boot, post-mortems target the current run. On Coffee
+ * the whole ring is reserved up front, so the file never has to grow (and
+ * possibly fail to) once the node is running.
+ */
+static int fd = -1;
+static uint16_t head = 0;     // next slot to write
+static uint16_t count = 0;
+static uint32_t appended = 0; // records written since boot
+
+void diag_log_init(void) {
+    cfs_remove(DIAG_LOG_FILE);
+#ifndef CONTIKI_TARGET_NATIVE
+    if (cfs_coffee_reserve(DIAG_LOG_FILE, (cfs_offset_t)DIAG_LOG_RECORDS * DIAG_RECORD_SIZE) < 0) {
+        LOG_WARN("cannot reserve %s, diagnostic logging disabled\n", DIAG_LOG_FILE);
+        return;
+    }
+#endif
+    fd = cfs_open(DIAG_LOG_FILE, CFS_READ | CFS_WRITE);
+    head = 0;
+    count = 0;
+    appended = 0;
+    if (fd < 0) {
+        LOG_WARN("cannot open %s, diagnostic logging disabled\n", DIAG_LOG_FILE);
+    }
+}
+
+void diag_log_append(const diag_record_t *rec) {
+    if (fd < 0) return;
+
+    cfs_offset_t pos = (cfs_offset_t)head * DIAG_RECORD_SIZE;
+    if (cfs_seek(fd, pos, CFS_SEEK_SET) != pos ||
+        cfs_write(fd, rec, DIAG_RECORD_SIZE) != DIAG_RECORD_SIZE) {
+        LOG_WARN("write failed at slot %u\n", head);
+        return;
+    }
+
+    head = (head + 1) % DIAG_LOG_RECORDS;
+    if (count < DIAG_LOG_RECORDS) count++;
+    appended++;
+}
+
+uint16_t diag_log_count(void) {
+    return count;
+}
+
+uint32_t diag_log_first_seq(void) {
+    return appended - count;
+}
+
+int diag_log_read(uint16_t i, diag_record_t *rec) {
+    if (fd < 0 || i >= count) return -1;
+
+    uint16_t slot = (head + DIAG_LOG_RECORDS - count + i) % DIAG_LOG_RECORDS;
+    cfs_offset_t pos = (cfs_offset_t)slot * DIAG_RECORD_SIZE;
+    if (cfs_seek(fd, pos, CFS_SEEK_SET) != pos ||
+        cfs_read(fd, rec, DIAG_RECORD_SIZE) != DIAG_RECORD_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+int diag_log_read_seq(uint32_t seq, diag_record_t *rec) {
+    uint32_t first = diag_log_first_seq();
+    if (seq < first || seq >= appended) return -1;
+    return diag_log_read((uint16_t)(seq - first), rec);
+}
@@ -0,0 +1,97 @@
+#include "contiki.h"
+#include <stdlib.h>
+#include <string.h>
+#include "coap-engine.h"
+#include "coap.h"
+#include "sys/log.h"
+#include "../../includes/diag_log.h"
+#include "../../includes/coap_stats.h"
+
+#define LOG_MODULE "diag"
+#define LOG_LEVEL LOG_LEVEL_APP
+
+/*
+ * GET dev/diag[?from=<s>&to=<s>]
+ * streams the diagnostic records with from <= t <= to (clock_seconds) as
+ * raw diag_record_t entries, Block2-wise; without a query the whole ring is
+ * returned. The range is resolved at block 0 and kept as sequence numbers,
+ * so records appended (and wrapping the ring) during the transfer do not
+ * shift later blocks. One transfer at a time: a new block 0 restarts it.
+ */
+static uint32_t xfer_first, xfer_last;   // [first, last) sequence numbers
+
+// first index with t >= ts (records are appended in time order)
+static uint16_t lower_bound(uint32_t ts) {
+    uint16_t lo = 0, hi = diag_log_count();
+    diag_record_t rec;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (diag_log_read(mid, &rec) == 0 && rec.t < ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static uint32_t query_u32(coap_message_t *req, const char *name, uint32_t def) {
+    const char *str = NULL;
+    char tmp[12];
+    int len = coap_get_query_variable(req, name, &str);
+    if (len <= 0 || len >= (int)sizeof(tmp)) return def;
+    memcpy(tmp, str, len);
+    tmp[len] = '\0';
+    return (uint32_t)strtoul(tmp, NULL, 10);
+}
+
+static void res_get_diag_h(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    if (*off == 0) {
+        uint32_t from = query_u32(req, "from", 0);
+        uint32_t to = query_u32(req, "to", UINT32_MAX);
+        uint32_t base = diag_log_first_seq();
+
+        xfer_first = base + lower_bound(from);
+        xfer_last = base + ((to == UINT32_MAX) ? diag_log_count() : lower_bound(to + 1));
+    }
+    int32_t total = (xfer_last > xfer_first) ? (int32_t)(xfer_last - xfer_first) * DIAG_RECORD_SIZE : 0;
+
+    coap_stats_rx(STATS_RES_DIAG, 0);
+
+    if (*off > total) {
+        coap_set_status_code(res, BAD_OPTION_4_02);
+        return;
+    }
+
+    uint16_t len = 0;
+    diag_record_t rec;
+    while (len < size && *off + len < total) {
+        int32_t pos = *off + len;
+        uint32_t seq = xfer_first + pos / DIAG_RECORD_SIZE;
+        uint16_t skip = pos % DIAG_RECORD_SIZE;
+        uint16_t chunk = DIAG_RECORD_SIZE - skip;
+        if (chunk > size - len) chunk = size - len;
+
+        if (diag_log_read_seq(seq, &rec) != 0) {
+            // overwritten during the transfer: the client restarts from block 0
+            coap_set_status_code(res, SERVICE_UNAVAILABLE_5_03);
+            return;
+        }
+        memcpy(buf + len, (uint8_t *)&rec + skip, chunk);
+        len += chunk;
+    }
+
+    coap_stats_tx(STATS_RES_DIAG, len);
+
+    coap_set_header_content_format(res, APPLICATION_OCTET_STREAM);
+    coap_set_payload(res, buf, len);
+
+    *off += len;
+    if (*off >= total) {
+        *off = -1;
+    }
+}
+
+RESOURCE(res_dev_diag, "title=\"Diagnostics\";ct=42", res_get_diag_h, NULL, NULL, NULL);
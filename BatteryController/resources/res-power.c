@@ -5,6 +5,7 @@
 #include "coap.h"
 #include "../../includes/constants.h"
 #include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
 #include "sys/log.h"
 
 #define LOG_MODULE "state"
@@ -27,6 +28,7 @@ static void res_power_put_handler(coap_message_t *req, coap_message_t *res,
 
     const uint8_t *chunk;
     int len = coap_get_payload(req, &chunk);
+    coap_stats_rx(STATS_RES_POWER, len);
     int param;
     float req_p;
 
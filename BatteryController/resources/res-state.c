@@ -5,6 +5,7 @@
 #include "coap.h"
 #include "sys/log.h"
 #include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
 
 #define LOG_MODULE "state"
 #define LOG_LEVEL LOG_LEVEL_APP
@@ -18,7 +19,7 @@ extern coap_resource_t res_dev_state;
 extern battery_state_t current_state;
 
 static void res_state_periodic_handler(void) {
-    coap_notify_observers(&res_dev_state);
+    coap_stats_notify(&res_dev_state);
 }
 
 static void res_get_state_h(coap_message_t *req, coap_message_t *res, 
@@ -48,6 +49,9 @@ static void res_get_state_h(coap_message_t *req, coap_message_t *res,
             (int)(bat_soh * 10000),     // 0.91 → 9100 (91.00%)
             current_state);
 
+    coap_stats_rx(STATS_RES_STATE, 0);
+    coap_stats_tx(STATS_RES_STATE, len);
+
     coap_set_header_content_format(res, APPLICATION_JSON);
     coap_set_payload(res, buf, len);
 }
@@ -1,7 +1,9 @@
 import json
+import queue
 import threading
 import time
 from collections import deque
+from itertools import count
 from typing import Optional, Dict, Any, Tuple
 
 import curses
@@ -19,6 +21,12 @@ MQTT_ALERT_TOPIC = "ugrid/alerts/#"
 STATUS_REFRESH_INTERVAL = 2.0
 BATTERY_ENERGY_KWH = 13.5
 
+# Sparkline storiche (SoC, potenza, temperatura) per batteria
+SPARK_POINTS = 48            # budget punti per serie (richiesti con points=N)
+SPARK_MAX_ROWS = 8           # righe massime del pannello
+SPARK_SERIES = (("soc", "SoC"), ("power_kw", "P"), ("temperature", "T"))
+SPARK_CHARS = "▁▂▃▄▅▆▇█"
+
 # ---------------------------------------------------------------------------
 # STATO CONDIVISO
 # ---------------------------------------------------------------------------
@@ -31,6 +39,35 @@ alerts = deque(maxlen=100)  # (level, text)
 
 stop_event = threading.Event()
 
+# riga di stato: scritta dal loop TUI e dal worker dei comandi
+status_msg_lock = threading.Lock()
+status_msg = ""
+
+# comandi verso la RCA eseguiti fuori dal loop curses
+command_queue: "queue.Queue" = queue.Queue()
+
+# obiettivi applicati localmente in attesa di conferma dalla RCA:
+# (ugrid, bat) -> (mode, target_soc, token); sovrascrivono i dati del polling.
+# Il token identifica il comando che ha scritto l'override: solo quello lo toglie
+local_overrides_lock = threading.Lock()
+local_overrides: Dict[Tuple[str, int], Tuple[Optional[str], Optional[float], int]] = {}
+local_override_tokens = count(1)
+
+# cache sparkline: (ugrid, bat) -> {"series": {key: deque}, "last_ts": str, "render": {...}}
+spark_lock = threading.Lock()
+spark_cache: Dict[Tuple[str, int], Dict[str, Any]] = {}
+spark_backfill: "queue.Queue" = queue.Queue()
+spark_visible = False
+
+def set_status(msg: str):
+    global status_msg
+    with status_msg_lock:
+        status_msg = msg
+
+def get_status() -> str:
+    with status_msg_lock:
+        return status_msg
+
 # ---------------------------------------------------------------------------
 # HTTP helpers
 # ---------------------------------------------------------------------------
@@ -102,18 +139,125 @@ def start_mqtt_listener():
 # THREAD DI POLLING STATO
 # ---------------------------------------------------------------------------
 
+def apply_local_overrides(data: Dict[str, Any]):
+    with local_overrides_lock:
+        overrides = dict(local_overrides)
+    if not overrides:
+        return
+    for ugrid_id, info in data.items():
+        for b in info.get("batteries", []):
+            key = (ugrid_id, int(b.get("index", 0)))
+            if key in overrides:
+                b["objective_mode"], b["objective_target_soc"] = overrides[key][:2]
+
 def poll_status_loop():
     while not stop_event.is_set():
         try:
             data = rca_get("/api/status")
+            apply_local_overrides(data)
             with status_data_lock:
                 global status_data
                 status_data = data
+            update_sparklines(data)
         except Exception as e:
             with alerts_lock:
                 alerts.append(("ERROR", f"[RCA] Errore lettura /api/status: {e}"))
         time.sleep(STATUS_REFRESH_INTERVAL)
 
+# ---------------------------------------------------------------------------
+# SPARKLINE (history downsampled + feed live)
+# ---------------------------------------------------------------------------
+
+def _new_spark_entry() -> Dict[str, Any]:
+    return {
+        "series": {k: deque(maxlen=SPARK_POINTS) for k, _ in SPARK_SERIES},
+        "last_ts": "", "ready": False, "render": None,
+    }
+
+def update_sparklines(data: Dict[str, Any]):
+    # il feed live estende le serie di un punto per poll; le batterie nuove
+    # vengono riempite una sola volta dalla history a budget fisso
+    with spark_lock:
+        for ugrid_id, info in data.items():
+            for b in info.get("batteries", []):
+                key = (ugrid_id, int(b.get("index", 0)))
+                entry = spark_cache.get(key)
+                if entry is None:
+                    entry = spark_cache[key] = _new_spark_entry()
+                    spark_backfill.put(key)
+                ts = b.get("ts") or ""
+                if not entry["ready"] or ts <= entry["last_ts"]:
+                    continue
+                for k, _ in SPARK_SERIES:
+                    entry["series"][k].append(b.get(k))
+                entry["last_ts"] = ts
+                entry["render"] = None
+
+def spark_backfill_loop():
+    while not stop_event.is_set():
+        try:
+            ugrid_id, bat = spark_backfill.get(timeout=0.5)
+        except queue.Empty:
+            continue
+        try:
+            rows = rca_get(f"/api/batteries/{ugrid_id}/{bat}/history",
+                           params={"points": SPARK_POINTS, "y": "power_kw"})
+        except Exception as e:
+            with alerts_lock:
+                alerts.append(("ERROR", f"[RCA] Errore history {ugrid_id}/bat{bat}: {e}"))
+            with spark_lock:
+                spark_cache.pop((ugrid_id, bat), None)  # riprova al prossimo poll
+            continue
+
+        with spark_lock:
+            entry = spark_cache.setdefault((ugrid_id, bat), _new_spark_entry())
+            for r in reversed(rows):  # la history e' in ordine ts DESC
+                for k, _ in SPARK_SERIES:
+                    entry["series"][k].append(r.get(k))
+            if rows:
+                entry["last_ts"] = rows[0].get("ts") or ""
+            entry["ready"] = True
+            entry["render"] = None
+
+def sparkline(values, width: int) -> str:
+    vals = [v for v in list(values)[-width:] if v is not None]
+    if not vals:
+        return ""
+    lo, hi = min(vals), max(vals)
+    span = (hi - lo) or 1.0
+    top = len(SPARK_CHARS) - 1
+    return "".join(SPARK_CHARS[int((v - lo) / span * top)] for v in vals)
+
+def draw_spark_panel(stdscr, start_y, max_y, max_x):
+    y = start_y
+    if not spark_visible or y >= max_y - 8:
+        return y
+
+    stdscr.attron(curses.color_pair(4) | curses.A_BOLD)
+    stdscr.addstr(y, 2, "Trend (SoC / P / T):")
+    stdscr.attroff(curses.color_pair(4) | curses.A_BOLD)
+    y += 1
+
+    label_w = 10
+    cell_w = max(8, (max_x - 6 - label_w) // len(SPARK_SERIES) - 6)
+    rows = min(SPARK_MAX_ROWS, max_y - 8 - y)
+
+    with spark_lock:
+        for key in sorted(spark_cache)[:max(rows, 0)]:
+            entry = spark_cache[key]
+            # le stringhe sono ricalcolate solo quando arrivano dati nuovi
+            # o cambia la larghezza: il costo per frame resta costante
+            if entry["render"] is None or entry["render"][0] != cell_w:
+                cells = []
+                for k, name in SPARK_SERIES:
+                    cells.append(f"{name:>3} {sparkline(entry['series'][k], cell_w):<{cell_w}}")
+                entry["render"] = (cell_w, " ".join(cells))
+            line = f"{key[0]}/{key[1]:<3}"[:label_w].ljust(label_w) + entry["render"][1]
+            stdscr.addstr(y, 4, line[: max_x - 6])
+            y += 1
+
+    return y + 1
+
 # ---------------------------------------------------------------------------
 # UTILITY PER COLORI / ETA
 # ---------------------------------------------------------------------------
@@ -461,6 +605,50 @@ def draw_command_line(stdscr, cmd_buffer: str, status_msg: str):
     stdscr.addstr(y_cmd, 2 + len(prompt), visible)
     stdscr.move(y_cmd, 2 + len(prompt) + len(visible))
 
+# ---------------------------------------------------------------------------
+# ESECUZIONE ASINCRONA COMANDI
+# ---------------------------------------------------------------------------
+
+def set_local_objective(ugrid: str, bat: int, mode: Optional[str], target: Optional[float]) -> int:
+    # aggiornamento ottimistico: visibile subito in tabella
+    with local_overrides_lock:
+        token = next(local_override_tokens)
+        local_overrides[(ugrid, bat)] = (mode, target, token)
+    with status_data_lock:
+        for b in status_data.get(ugrid, {}).get("batteries", []):
+            if int(b.get("index", 0)) == bat:
+                b["objective_mode"], b["objective_target_soc"] = mode, target
+    return token
+
+def drop_local_objective(ugrid: str, bat: int, token: int):
+    # il prossimo /api/status riporta lo stato reale (anche in caso di errore);
+    # se nel frattempo un altro comando ha riscritto l'override, resta il suo
+    with local_overrides_lock:
+        cur = local_overrides.get((ugrid, bat))
+        if cur is not None and cur[2] == token:
+            del local_overrides[(ugrid, bat)]
+
+def submit_command(label: str, fn, on_done=None):
+    command_queue.put((label, fn, on_done))
+    pending = command_queue.qsize()
+    return f"⏳ {label} (in coda: {pending})"
+
+def command_worker_loop():
+    while not stop_event.is_set():
+        try:
+            label, fn, on_done = command_queue.get(timeout=0.5)
+        except queue.Empty:
+            continue
+        try:
+            msg = fn()
+            set_status(f"✓ {msg}")
+        except Exception as e:
+            set_status(f"✗ {label}: {e}")
+        finally:
+            if on_done:
+                on_done()
+            command_queue.task_done()
+
 # ---------------------------------------------------------------------------
 # PARSING COMANDI
 # ---------------------------------------------------------------------------
@@ -474,6 +662,7 @@ HELP_TEXT = (
     "  clear <ugrid> <bat>       rimuove obiettivo per batteria\n"
     "  setmpc <ugrid> a b g [p]  cambia alpha, beta, gamma, price opzionale\n"
     "  pullalerts [N]            recupera ultimi N alert da /api/alerts\n"
+    "  spark                     mostra/nasconde i trend SoC/P/T\n"
     "  quit / exit               esce\n"
 )
 
@@ -487,6 +676,11 @@ def run_command(cmd: str) -> Tuple[str, bool]:
     if c in ("quit", "exit"):
         return "Uscita...", True
 
+    if c == "spark":
+        global spark_visible
+        spark_visible = not spark_visible
+        return f"Trend {'visibili' if spark_visible else 'nascosti'}.", False
+
     if c == "help":
         for line in HELP_TEXT.splitlines():
             if not line.strip():
@@ -501,9 +695,13 @@ def run_command(cmd: str) -> Tuple[str, bool]:
                 return "Uso: fd <ugrid> <bat>", False
             ugrid = parts[1]
             bat = int(parts[2])
-            res = rca_post(f"/api/batteries/{ugrid}/{bat}/objective",
-                           {"mode": "full_discharge"})
-            return f"full_discharge impostato su {ugrid}/bat{bat}: {res}", False
+            def job():
+                res = rca_post(f"/api/batteries/{ugrid}/{bat}/objective",
+                               {"mode": "full_discharge"})
+                return f"full_discharge impostato su {ugrid}/bat{bat}: {res}"
+            tok = set_local_objective(ugrid, bat, "full_discharge", None)
+            return submit_command(f"fd {ugrid}/bat{bat}", job,
+                                  lambda: drop_local_objective(ugrid, bat, tok)), False
 
         if c == "setsoc":
             if len(parts) != 4:
@@ -512,26 +710,38 @@ def run_command(cmd: str) -> Tuple[str, bool]:
             bat = int(parts[2])
             perc = float(parts[3])
             target_soc = perc / 100.0
-            res = rca_post(f"/api/batteries/{ugrid}/{bat}/objective",
-                           {"mode": "target_soc", "target_soc": target_soc})
-            return f"target SoC {perc:.1f}% impostato su {ugrid}/bat{bat}: {res}", False
+            def job():
+                res = rca_post(f"/api/batteries/{ugrid}/{bat}/objective",
+                               {"mode": "target_soc", "target_soc": target_soc})
+                return f"target SoC {perc:.1f}% impostato su {ugrid}/bat{bat}: {res}"
+            tok = set_local_objective(ugrid, bat, "target_soc", target_soc)
+            return submit_command(f"setsoc {ugrid}/bat{bat}", job,
+                                  lambda: drop_local_objective(ugrid, bat, tok)), False
 
         if c == "detach":
             if len(parts) != 3:
                 return "Uso: detach <ugrid> <bat>", False
             ugrid = parts[1]
             bat = int(parts[2])
-            res = rca_post(f"/api/batteries/{ugrid}/{bat}/objective",
-                           {"mode": "detach"})
-            return f"detach impostato su {ugrid}/bat{bat}: {res}", False
+            def job():
+                res = rca_post(f"/api/batteries/{ugrid}/{bat}/objective",
+                               {"mode": "detach"})
+                return f"detach impostato su {ugrid}/bat{bat}: {res}"
+            tok = set_local_objective(ugrid, bat, "detach", None)
+            return submit_command(f"detach {ugrid}/bat{bat}", job,
+                                  lambda: drop_local_objective(ugrid, bat, tok)), False
 
         if c == "clear":
             if len(parts) != 3:
                 return "Uso: clear <ugrid> <bat>", False
             ugrid = parts[1]
             bat = int(parts[2])
-            res = rca_delete(f"/api/batteries/{ugrid}/{bat}/objective")
-            return f"Obiettivo rimosso per {ugrid}/bat{bat}: {res}", False
+            def job():
+                res = rca_delete(f"/api/batteries/{ugrid}/{bat}/objective")
+                return f"Obiettivo rimosso per {ugrid}/bat{bat}: {res}"
+            tok = set_local_objective(ugrid, bat, None, None)
+            return submit_command(f"clear {ugrid}/bat{bat}", job,
+                                  lambda: drop_local_objective(ugrid, bat, tok)), False
 
         if c == "setmpc":
             if len(parts) not in (5, 6):
@@ -543,22 +753,26 @@ def run_command(cmd: str) -> Tuple[str, bool]:
             body = {"alpha": alpha, "beta": beta, "gamma": gamma}
             if len(parts) == 6:
                 body["price"] = float(parts[5])
-            res = rca_post(f"/api/ugrids/{ugrid}/mpc_params", body)
-            return f"MPC params aggiornati per {ugrid}: {res}", False
+            def job():
+                res = rca_post(f"/api/ugrids/{ugrid}/mpc_params", body)
+                return f"MPC params aggiornati per {ugrid}: {res}"
+            return submit_command(f"setmpc {ugrid}", job), False
 
         if c == "pullalerts":
             limit = 20
             if len(parts) >= 2:
                 limit = int(parts[1])
-            data = rca_get("/api/alerts", params={"limit": limit})
-            if not data:
-                return "Nessun alert nel DB.", False
-            for a in reversed(data):
-                level = str(a.get("level", "info")).upper()
-                text = f"{a.get('ts','')} {a.get('ugrid_id','?')}/bat{a.get('battery_index','?')}: {a.get('message','')}"
-                with alerts_lock:
-                    alerts.append((level, text))
-            return f"{len(data)} alert caricati dal DB.", False
+            def job():
+                data = rca_get("/api/alerts", params={"limit": limit})
+                if not data:
+                    return "Nessun alert nel DB."
+                for a in reversed(data):
+                    level = str(a.get("level", "info")).upper()
+                    text = f"{a.get('ts','')} {a.get('ugrid_id','?')}/bat{a.get('battery_index','?')}: {a.get('message','')}"
+                    with alerts_lock:
+                        alerts.append((level, text))
+                return f"{len(data)} alert caricati dal DB."
+            return submit_command(f"pullalerts {limit}", job), False
 
         return f"Comando sconosciuto: {c}. Digita 'help' per la lista.", False
 
@@ -577,7 +791,6 @@ def tui_main(stdscr):
     init_colors()
 
     cmd_buffer = ""
-    status_msg = ""
 
     while True:
         stdscr.erase()
@@ -588,9 +801,11 @@ def tui_main(stdscr):
         y = 3
         y = draw_status_panel(stdscr, y, max_y, max_x)
 
+        y = draw_spark_panel(stdscr, y, max_y, max_x)
+
         y = draw_alerts_panel(stdscr, y, max_y, max_x)
 
-        draw_command_line(stdscr, cmd_buffer, status_msg)
+        draw_command_line(stdscr, cmd_buffer, get_status())
 
         stdscr.refresh()
 
@@ -601,7 +816,8 @@ def tui_main(stdscr):
         if ch in (curses.KEY_ENTER, 10, 13):
             cmd = cmd_buffer.strip()
             cmd_buffer = ""
-            status_msg, should_exit = run_command(cmd)
+            msg, should_exit = run_command(cmd)
+            set_status(msg)
             if should_exit:
                 break
         elif ch in (curses.KEY_BACKSPACE, 127, 8):
@@ -618,6 +834,12 @@ def main():
     poller = threading.Thread(target=poll_status_loop, daemon=True)
     poller.start()
 
+    worker = threading.Thread(target=command_worker_loop, daemon=True)
+    worker.start()
+
+    backfill = threading.Thread(target=spark_backfill_loop, daemon=True)
+    backfill.start()
+
     start_mqtt_listener()
 
     curses.wrapper(tui_main)
@@ -0,0 +1,71 @@
+"""
+Physics of the RCA digital twin: battery_derate_power() + battery_physics_step()
+from includes/battery_physics.h, without noise, on numpy arrays.
+
+The constants are read from the node header at startup rather than copied,
+so a retuned node model cannot silently drift from the twin.
+tools/twin_check compares one step against the C kernel.
+"""
+
+import os
+import re
+
+import numpy as np
+
+PHYSICS_HEADER = os.environ.get(
+    "BATTERY_PHYSICS_H",
+    os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "includes", "battery_physics.h"))
+
+# nomi come nell'header: #define di file o const float di battery_physics_step()
+PHYSICS_CONSTANTS = (
+    "SCALED_CAPACITY_AH",
+    "SOC_EMPTY_CUTOFF", "SOC_DERATE_DISCHARGE", "SOC_FULL_CUTOFF", "SOC_DERATE_CHARGE",
+    "NOMINAL_VOLTAGE", "V_MIN", "V_MAX", "INTERNAL_RESISTANCE",
+    "THERMAL_MASS", "HEAT_DISSIPATION", "AMBIENT_TEMP", "EFFICIENCY",
+    "MAX_C_RATE", "TEMP_MAX",
+)
+
+_NUM = r"([-+]?(?:\d+\.?\d*|\.\d+)(?:[eE][-+]?\d+)?)f?"
+_DEFINE = re.compile(r"^\s*#define\s+(\w+)\s+" + _NUM + r"(?![\w.])", re.M)
+_CONST = re.compile(r"\bconst\s+float\s+(\w+)\s*=\s*" + _NUM + r"\s*;")
+
+
+def load_constants(path: str = PHYSICS_HEADER) -> dict:
+    with open(path) as f:
+        src = f.read()
+    found = {name: float(v) for name, v in _DEFINE.findall(src)}
+    found.update({name: float(v) for name, v in _CONST.findall(src)})
+    missing = [n for n in PHYSICS_CONSTANTS if n not in found]
+    if missing:
+        raise ValueError(f"{path}: costanti mancanti {', '.join(missing)}")
+    return {n: found[n] for n in PHYSICS_CONSTANTS}
+
+
+def derate_power(k: dict, soc, power_w):
+    # battery_derate_power()
+    p = power_w
+    empty, dis_lo = k["SOC_EMPTY_CUTOFF"], k["SOC_DERATE_DISCHARGE"]
+    full, chg_hi = k["SOC_FULL_CUTOFF"], k["SOC_DERATE_CHARGE"]
+    dis = p < -0.5
+    p = np.where(dis & (soc <= empty), 0.0, p)
+    p = np.where(dis & (soc > empty) & (soc < dis_lo),
+                 p * np.clip((soc - empty) / (dis_lo - empty), 0.0, None), p)
+    chg = p > 0.5
+    p = np.where(chg & (soc >= full), 0.0, p)
+    p = np.where(chg & (soc < full) & (soc > chg_hi),
+                 p * np.clip((full - soc) / (full - chg_hi), 0.0, None), p)
+    return p
+
+
+def physics_step(k: dict, soc, temp, soh, power_w, dt):
+    # battery_physics_step(): corrente, SoC, temperatura (SoH dalle misure)
+    ocv = k["V_MIN"] + (k["V_MAX"] - k["V_MIN"]) * soc
+    max_i = k["SCALED_CAPACITY_AH"] * k["MAX_C_RATE"]
+    current = np.clip(np.where(ocv > 0.1, power_w / ocv, 0.0), -max_i, max_i)
+    eff = np.where(current > 0, k["EFFICIENCY"], 1.0 / k["EFFICIENCY"])
+    capacity_j = k["SCALED_CAPACITY_AH"] * soh * k["NOMINAL_VOLTAGE"] * 3600.0
+    soc = np.clip(soc + power_w * eff * dt / capacity_j, 0.0, 1.0)
+    heat = current * current * k["INTERNAL_RESISTANCE"] * dt
+    cooling = k["HEAT_DISSIPATION"] * (temp - k["AMBIENT_TEMP"]) * dt
+    temp = np.clip(temp + (heat - cooling) / k["THERMAL_MASS"], 0.0, k["TEMP_MAX"])
+    return soc, temp
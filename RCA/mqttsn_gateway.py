@@ -0,0 +1,93 @@
+"""
+MQTT-SN -> MQTT gateway stand-in for the lab (transparent, QoS -1 only).
+
+The uGrid publishes its CBOR state as MQTT-SN PUBLISH datagrams on a
+predefined topic id (includes/mqttsn.h). This process maps each topic id to
+an MQTT topic and forwards the payload untouched to the broker, where the
+RCA subscribes to MQTT_STATE_TOPIC_BASE/+.
+
+    python3 mqttsn_gateway.py --topic 1=ug1 [--topic 2=ug2 ...]
+
+The topic id of each uGrid is set when building its firmware
+(make MQTTSN=1 MQTTSN_TOPIC=2) and must be unique per gateway.
+"""
+
+import argparse
+import logging
+import socket
+import struct
+
+import paho.mqtt.client as mqtt
+
+MQTT_BROKER_HOST = "localhost"
+MQTT_BROKER_PORT = 1883
+MQTT_STATE_TOPIC_BASE = "ugrid/state"
+
+MQTTSN_PORT = 1884
+MQTTSN_PUBLISH = 0x0C
+MQTTSN_QOS_M1 = 0x60
+MQTTSN_TOPIC_PREDEF = 0x01
+
+logging.basicConfig(level=logging.INFO, format="%(asctime)s [%(levelname)s] %(message)s")
+logger = logging.getLogger("mqttsn-gw")
+
+
+def parse_publish(dgram: bytes):
+    # ritorna (topic_id, data) oppure None se non e' un PUBLISH QoS -1 predefinito
+    if len(dgram) < 7:
+        return None
+    if dgram[0] == 0x01:
+        length = struct.unpack_from(">H", dgram, 1)[0]
+        hdr = 3
+    else:
+        length = dgram[0]
+        hdr = 1
+    if length != len(dgram) or len(dgram) < hdr + 6:
+        return None
+    msg_type, flags, topic_id = struct.unpack_from(">BBH", dgram, hdr)
+    if msg_type != MQTTSN_PUBLISH:
+        return None
+    if flags & 0x60 != MQTTSN_QOS_M1 or flags & 0x03 != MQTTSN_TOPIC_PREDEF:
+        return None
+    return topic_id, dgram[hdr + 6:]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--topic", action="append", default=[], metavar="ID=UGRID",
+                    help="predefined topic id -> uGrid id")
+    ap.add_argument("--broker", default=MQTT_BROKER_HOST)
+    ap.add_argument("--broker-port", type=int, default=MQTT_BROKER_PORT)
+    ap.add_argument("--port", type=int, default=MQTTSN_PORT)
+    args = ap.parse_args()
+
+    topics = {}
+    for t in args.topic or ["1=ug1"]:
+        tid, ugrid_id = t.split("=", 1)
+        topics[int(tid)] = f"{MQTT_STATE_TOPIC_BASE}/{ugrid_id}"
+
+    client = mqtt.Client()
+    client.connect(args.broker, args.broker_port, keepalive=60)
+    client.loop_start()
+
+    sock = socket.socket(socket.AF_INET6, socket.SOCK_DGRAM)
+    sock.bind(("::", args.port))
+    logger.info(f"In ascolto su [::]:{args.port}, topic {topics}")
+
+    forwarded = dropped = 0
+    while True:
+        dgram, addr = sock.recvfrom(2048)
+        msg = parse_publish(dgram)
+        topic = topics.get(msg[0]) if msg else None
+        if topic is None:
+            dropped += 1
+            logger.warning(f"Datagramma scartato da {addr[0]} ({len(dgram)} B), scartati {dropped}")
+            continue
+        client.publish(topic, payload=msg[1], qos=0)
+        forwarded += 1
+        if forwarded % 100 == 1:
+            logger.info(f"{topic} <- {addr[0]} ({len(msg[1])} B), inoltrati {forwarded}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,20 +1,41 @@
+import gzip
 import json
 import logging
+import os
 import signal
 import sys
 import threading
 import time
+import uuid
+from collections import OrderedDict
 from urllib.parse import urlparse
 from datetime import datetime
 from typing import Optional, Dict, Any, Tuple, Union
 
-from flask import Flask, jsonify, request, abort
+from flask import Flask, Response, jsonify, request, abort
 import mysql.connector
 import paho.mqtt.client as mqtt
 from coapthon.client.helperclient import HelperClient
 from coapthon import defines
 import cbor2
 
+try:
+    import brotli
+except ImportError:
+    brotli = None
+
+try:
+    import numpy as np
+    import battery_twin
+except ImportError:
+    np = None
+
+try:
+    import uvicorn
+    from asgiref.wsgi import WsgiToAsgi
+except ImportError:
+    uvicorn = None
+
 # ---------------------------------------------------------------------------
 # CONFIGURAZIONE
 # ---------------------------------------------------------------------------
@@ -33,10 +54,15 @@ DROP_SCHEMA_ON_STARTUP = False
 MQTT_BROKER_HOST = "localhost"
 MQTT_BROKER_PORT = 1883
 MQTT_ALERT_TOPIC_BASE = "ugrid/alerts"
+# stato pubblicato dal uGrid via MQTT-SN (il gateway lo inoltra su <base>/<ugrid_id>)
+MQTT_STATE_TOPIC_BASE = "ugrid/state"
 
+# uplink: "coap" = poll GET /dev/state, "mqtt" = stato ricevuto dal broker
+# (firmware compilato con MQTTSN=1); i comandi restano comunque CoAP
 UGRIDS = {
     "ug1": {
         "coap_state_uri": "coap://[fd00::f6ce:36ac:9afa:6be2]/dev/state",
+        "uplink": "coap",
     },
 }
 
@@ -51,6 +77,60 @@ TEMP_HIGH_CRITICAL = 50.0
 MAX_CHARGE_POWER_KW = 5.0   
 MAX_DISCH_POWER_KW  = -5.0  
 
+# Statistiche CoAP dei nodi (/dev/stats)
+STATS_POLL_INTERVAL_SEC = 60.0
+STATS_RESOURCES = ("dev/state", "dev/power", "dev/register", "ctrl", "dev/stats", "dev/diag")
+
+# Controllo gerarchico: la RCA fa da coordinatore dei uGrid controller
+HIERARCHICAL_MODE = False
+COORD_SETPOINT_TTL_SEC = 15     # ~3 cicli MPC, poi il uGrid torna autonomo
+COORD_FLEX_MAX_AGE_SEC = 3 * POLL_INTERVAL_SEC
+
+# Snapshot stato in memoria (riavvio veloce)
+SNAPSHOT_PATH = "rca_snapshot.json"
+SNAPSHOT_INTERVAL_SEC = 30.0
+
+# Rilevamento anomalie streaming (per batteria, O(1) per campione)
+ANOMALY_EWMA_ALPHA = 0.1        # smoothing per media/varianza
+ANOMALY_DRIFT_ALPHA = 0.05      # smoothing lento per errore di tracking
+ANOMALY_WARMUP_SAMPLES = 12     # campioni prima di emettere alert
+ANOMALY_Z_THRESHOLD = 4.0
+TEMP_RISE_MIN_C_PER_MIN = 0.5   # sotto questa pendenza non allarmiamo
+TRACKING_DRIFT_KW = 1.0         # bias medio |p - u*| tollerato
+SOH_SLOPE_ALERT_PER_H = -0.01   # perdita di SoH oltre 1%/h
+
+# Digital twin vettoriale (modello di battery_physics.h su tutte le batterie)
+TWIN_ENABLED = True
+TWIN_NODE_PERIOD_SEC = 1.0      # il nodo recupera un passo fisico al secondo...
+TWIN_STEP_DT = 1.0              # ...che simula 1 s
+TWIN_SOC_TOL = 0.03             # oltre la quantizzazione di /dev/state (0.01)
+TWIN_TEMP_TOL_C = 3.0           # il rumore termico del nodo e' +-0.5°C a passo
+TWIN_DISAGREE_POLLS = 3         # poll consecutivi discordanti prima dell'alert
+
+# Downsampling history (LTTB)
+HISTORY_MAX_ROWS = 100000       # finestra massima scansionata con points=N
+HISTORY_POINTS_MIN = 3          # LTTB tiene sempre primo e ultimo punto
+HISTORY_POINTS_MAX = 5000
+HISTORY_FETCH_CHUNK = 1000
+HISTORY_SERIES = {"soc", "soh", "voltage", "temperature", "current",
+                  "power_kw", "optimal_u_kw", "grid_power_kw", "load_kw",
+                  "pv_kw", "profit_eur"}
+
+# Rate limiting scritture CoAP verso ogni uGrid (token bucket)
+COAP_WRITE_RATE_PER_SEC = 2.0   # token ricaricati al secondo
+COAP_WRITE_BURST = 4            # capacita' del bucket
+COAP_WRITE_TIMEOUT_SEC = 3.0
+COAP_WRITE_WORKERS = 4          # PUT bloccanti in parallelo, al piu' una per uGrid
+PRIO_SAFETY = 0                 # clear/detach: scavalcano il bucket
+PRIO_NORMAL = 1
+
+# HTTP API
+HTTP_HOST = "0.0.0.0"
+HTTP_PORT = 3000
+COMPRESS_MIN_BYTES = 1024
+# path compressi (history e alert sono le risposte piu' grandi)
+COMPRESS_PATH_SUFFIXES = ("/history", "/site_history", "/api/alerts")
+
 logging.basicConfig(
     level=logging.INFO,
     format="[%(asctime)s] %(levelname)s %(name)s: %(message)s",
@@ -89,6 +169,7 @@ def init_database():
         cur.execute("DROP TABLE IF EXISTS objectives")
         cur.execute("DROP TABLE IF EXISTS mpc_params")
         cur.execute("DROP TABLE IF EXISTS telemetry")
+        cur.execute("DROP TABLE IF EXISTS site_telemetry")
 
     cur.execute("""
         CREATE TABLE IF NOT EXISTS telemetry (
@@ -103,12 +184,27 @@ def init_database():
             current       FLOAT,
             power_kw      FLOAT,
             optimal_u_kw  FLOAT,
-            grid_power_kw FLOAT,
-            load_kw       FLOAT,
-            pv_kw         FLOAT,
-            profit_eur    FLOAT
+            profit_eur    FLOAT,
+            poll_id       BIGINT,
+            INDEX idx_tel_poll (poll_id)
+        ) ENGINE=InnoDB
+    """)
+
+    # campi di sito: una riga per poll di uGrid invece che per batteria;
+    # l'indice copre le query di sito (index-only)
+    cur.execute("""
+        CREATE TABLE IF NOT EXISTS site_telemetry (
+            poll_id         BIGINT AUTO_INCREMENT PRIMARY KEY,
+            ugrid_id        VARCHAR(64) NOT NULL,
+            ts              TIMESTAMP   DEFAULT CURRENT_TIMESTAMP,
+            load_kw         FLOAT,
+            pv_kw           FLOAT,
+            grid_power_kw   FLOAT,
+            pv_curtailed_kw FLOAT,
+            INDEX idx_site_ugrid_ts (ugrid_id, ts, load_kw, pv_kw, grid_power_kw)
         ) ENGINE=InnoDB
     """)
+    _migrate_site_telemetry(cur)
 
     cur.execute("""
         CREATE TABLE IF NOT EXISTS objectives (
@@ -149,6 +245,59 @@ def init_database():
     logger.info("Database inizializzato")
 
 
+def _column_exists(cur, table, column):
+    cur.execute("""
+        SELECT COUNT(*) FROM information_schema.COLUMNS
+        WHERE TABLE_SCHEMA=%s AND TABLE_NAME=%s AND COLUMN_NAME=%s
+    """, (DB_NAME, table, column))
+    return cur.fetchone()[0] > 0
+
+def _index_exists(cur, table, index):
+    cur.execute("""
+        SELECT COUNT(*) FROM information_schema.STATISTICS
+        WHERE TABLE_SCHEMA=%s AND TABLE_NAME=%s AND INDEX_NAME=%s
+    """, (DB_NAME, table, index))
+    return cur.fetchone()[0] > 0
+
+def _migrate_site_telemetry(cur):
+    # schema precedente: load/pv/grid duplicati in ogni riga di batteria.
+    # Una riga di sito per (uGrid, ts), poi le colonne duplicate spariscono.
+    # Ogni passo e' rieseguibile: una migrazione interrotta riparte da dove
+    # si era fermata al prossimo avvio
+    if not _column_exists(cur, "telemetry", "load_kw"):
+        return
+
+    logger.warning("Migrazione telemetry -> site_telemetry in corso...")
+    if not _column_exists(cur, "telemetry", "poll_id"):
+        cur.execute("ALTER TABLE telemetry ADD COLUMN poll_id BIGINT")
+    if not _index_exists(cur, "telemetry", "idx_tel_poll"):
+        cur.execute("ALTER TABLE telemetry ADD INDEX idx_tel_poll (poll_id)")
+    # solo i poll non ancora copiati da un tentativo precedente
+    cur.execute("""
+        INSERT INTO site_telemetry (ugrid_id, ts, load_kw, pv_kw, grid_power_kw)
+        SELECT t.ugrid_id, t.ts, MAX(t.load_kw), MAX(t.pv_kw), MAX(t.grid_power_kw)
+        FROM telemetry t
+        WHERE NOT EXISTS (
+            SELECT 1 FROM site_telemetry s WHERE s.ugrid_id = t.ugrid_id AND s.ts = t.ts
+        )
+        GROUP BY t.ugrid_id, t.ts
+    """)
+    cur.execute("""
+        UPDATE telemetry t JOIN site_telemetry s ON s.ugrid_id = t.ugrid_id AND s.ts = t.ts
+        SET t.poll_id = s.poll_id
+        WHERE t.poll_id IS NULL
+    """)
+    cur.execute("ALTER TABLE telemetry DROP COLUMN load_kw, DROP COLUMN pv_kw, DROP COLUMN grid_power_kw")
+    logger.warning("Migrazione completata")
+
+
+# riga di telemetria per batteria con i campi di sito del suo poll
+TELEMETRY_SELECT = """
+    SELECT t.*, s.load_kw, s.pv_kw, s.grid_power_kw
+    FROM telemetry t LEFT JOIN site_telemetry s ON s.poll_id = t.poll_id
+"""
+
+
 # ---------------------------------------------------------------------------
 # HELPERS COAP (CoAPthon3 implementation)
 # ---------------------------------------------------------------------------
@@ -208,11 +357,158 @@ def coap_put(uri: str, payload: bytes, timeout: float = 5.0) -> bytes:
         if client:
             client.stop()
 
+# ---------------------------------------------------------------------------
+# RATE LIMITING SCRITTURE CoAP
+# ---------------------------------------------------------------------------
+
+class _UgridWriteQueue:
+    def __init__(self, rate: float, burst: int):
+        self.rate = rate
+        self.burst = burst
+        self.tokens = float(burst)
+        self.last_refill = time.monotonic()
+        # chiave risorsa -> (priorita', uri, payload, ts accodamento)
+        self.pending: "OrderedDict[Tuple, Tuple[int, str, bytes, float]]" = OrderedDict()
+        self.stats = {
+            "enqueued": 0, "coalesced": 0, "sent": 0, "failed": 0,
+            "safety_sent": 0, "max_depth": 0, "last_wait_ms": 0.0,
+        }
+        # una PUT in volo per uGrid: l'ordine per sito resta quello della coda
+        self.busy = False
+
+    def refill(self, now: float):
+        self.tokens = min(float(self.burst), self.tokens + (now - self.last_refill) * self.rate)
+        self.last_refill = now
+
+    def next_item(self) -> Optional[Tuple]:
+        # prima le azioni di sicurezza, poi FIFO per ordine di accodamento
+        best = None
+        for key, item in self.pending.items():
+            if best is None or item[0] < best[1][0]:
+                best = (key, item)
+        return best
+
+
+class CoapWriteLimiter:
+    """
+    Token bucket per uGrid sulle PUT CoAP generate dal cloud.
+    Le scritture sulla stessa risorsa vengono fuse (vince l'ultimo valore),
+    le azioni di sicurezza passano davanti e non attendono token (ma li
+    consumano, quindi il traffico di gestione successivo rallenta).
+    Un piccolo pool di writer serve le code a turno (round-robin), con al
+    piu' una PUT in volo per uGrid: un sito irraggiungibile blocca un solo
+    writer per COAP_WRITE_TIMEOUT_SEC, non le scritture verso gli altri.
+    """
+
+    def __init__(self, rate: float, burst: int):
+        self.rate = rate
+        self.burst = burst
+        self.queues: Dict[str, _UgridWriteQueue] = {}
+        self.cond = threading.Condition()
+        self.stop_event = threading.Event()
+        self.threads: list = []
+        self.rr_next = 0      # indice della prossima coda da servire
+
+    def _queue(self, ugrid_id: str) -> _UgridWriteQueue:
+        q = self.queues.get(ugrid_id)
+        if q is None:
+            q = self.queues[ugrid_id] = _UgridWriteQueue(self.rate, self.burst)
+        return q
+
+    def submit(self, ugrid_id: str, key: Tuple, uri: str, payload: bytes,
+               priority: int = PRIO_NORMAL):
+        with self.cond:
+            q = self._queue(ugrid_id)
+            q.stats["enqueued"] += 1
+            if key in q.pending:
+                q.stats["coalesced"] += 1
+                del q.pending[key]
+            q.pending[key] = (priority, uri, payload, time.monotonic())
+            q.stats["max_depth"] = max(q.stats["max_depth"], len(q.pending))
+            self.cond.notify()
+
+    def _take_ready(self) -> Tuple[Optional[Tuple], float]:
+        # restituisce (ugrid, uri, payload, priorita') pronto e il tempo
+        # di attesa minimo prima che un altro elemento diventi inviabile
+        now = time.monotonic()
+        wait = None
+        order = list(self.queues.items())
+        start = self.rr_next % len(order) if order else 0
+        for pos in range(len(order)):
+            ugrid_id, q = order[(start + pos) % len(order)]
+            if not q.pending or q.busy:
+                continue
+            q.refill(now)
+            key, (prio, uri, payload, ts) = q.next_item()
+            if prio == PRIO_SAFETY or q.tokens >= 1.0:
+                # i token possono andare in negativo solo per la sicurezza
+                q.tokens = max(q.tokens - 1.0, -float(q.burst))
+                del q.pending[key]
+                q.busy = True
+                q.stats["last_wait_ms"] = (now - ts) * 1000.0
+                self.rr_next = start + pos + 1
+                return (ugrid_id, uri, payload, prio), 0.0
+            missing = (1.0 - q.tokens) / q.rate
+            wait = missing if wait is None else min(wait, missing)
+        return None, wait
+
+    def _run(self):
+        while not self.stop_event.is_set():
+            with self.cond:
+                item, wait = self._take_ready()
+                if item is None:
+                    self.cond.wait(timeout=wait)
+                    continue
+
+            ugrid_id, uri, payload, prio = item
+            ok = True
+            try:
+                coap_put(uri, payload, timeout=COAP_WRITE_TIMEOUT_SEC)
+            except Exception as e:
+                ok = False
+                logger.error(f"Errore scrittura CoAP {uri}: {e}")
+
+            with self.cond:
+                q = self._queue(ugrid_id)
+                q.busy = False
+                stats = q.stats
+                # la coda puo' avere altro pronto per un writer in attesa
+                self.cond.notify()
+                if not ok:
+                    stats["failed"] += 1
+                else:
+                    stats["sent"] += 1
+                    if prio == PRIO_SAFETY:
+                        stats["safety_sent"] += 1
+
+    def start(self):
+        for _ in range(COAP_WRITE_WORKERS):
+            t = threading.Thread(target=self._run, daemon=True)
+            t.start()
+            self.threads.append(t)
+
+    def stop(self):
+        self.stop_event.set()
+        with self.cond:
+            self.cond.notify_all()
+
+    def metrics(self) -> Dict[str, Any]:
+        with self.cond:
+            out = {}
+            for ugrid_id, q in self.queues.items():
+                q.refill(time.monotonic())
+                out[ugrid_id] = dict(q.stats, depth=len(q.pending),
+                                     tokens=round(q.tokens, 2))
+            return out
+
+
+coap_writer = CoapWriteLimiter(COAP_WRITE_RATE_PER_SEC, COAP_WRITE_BURST)
+
 # ---------------------------------------------------------------------------
 # HELPERS Logica uGrid
 # ---------------------------------------------------------------------------
 
-def ugrid_obj_uri(ugrid_id: str) -> str:
+def ugrid_ctrl_uri(ugrid_id: str, path: str) -> str:
     cfg = UGRIDS[ugrid_id]
     state_uri = cfg["coap_state_uri"]
     host, port, _ = _parse_coap_uri(state_uri)
@@ -222,19 +518,37 @@ def ugrid_obj_uri(ugrid_id: str) -> str:
     else:
         host_str = host
         
-    return f"coap://{host_str}:{port}/ctrl/obj"
+    return f"coap://{host_str}:{port}/{path}"
+
+def ugrid_obj_uri(ugrid_id: str) -> str:
+    return ugrid_ctrl_uri(ugrid_id, "ctrl/obj")
+
+def send_ugrid_setpoint(ugrid_id: str, setpoint_kw: float, ttl_sec: int):
+    uri = ugrid_ctrl_uri(ugrid_id, "ctrl/flex")
+    payload = json.dumps({"sp": int(setpoint_kw * 100), "ttl": int(ttl_sec)},
+                         separators=(",", ":")).encode("utf-8")
+    coap_writer.submit(ugrid_id, ("flex",), uri, payload)
 
-def send_ugrid_objective(ugrid_id: str, battery_index: int, power_kw: float):
+def send_ugrid_objective(ugrid_id: str, battery_index: int, power_kw: float,
+                         priority: int = PRIO_NORMAL):
     uri = ugrid_obj_uri(ugrid_id)
     body = {"idx": battery_index, "power_kw": int(power_kw * 100), "clear": 0}
     payload = json.dumps(body).encode("utf-8")
-    coap_put(uri, payload)
+    coap_writer.submit(ugrid_id, ("obj", battery_index), uri, payload, priority)
+
+def send_ugrid_event(ugrid_id: str, delta_kw: float, duration_sec: int):
+    # evento di rete: il uGrid lo dispaccia subito fuori dal ciclo MPC,
+    # quindi scavalca anche il rate limit delle scritture
+    uri = ugrid_ctrl_uri(ugrid_id, "ctrl/event")
+    payload = json.dumps({"kw": int(round(delta_kw * 100)), "s": int(duration_sec)},
+                         separators=(",", ":")).encode("utf-8")
+    coap_writer.submit(ugrid_id, ("event",), uri, payload, PRIO_SAFETY)
 
 def clear_ugrid_objective(ugrid_id: str, battery_index: int):
     uri = ugrid_obj_uri(ugrid_id)
     body = {"idx": battery_index, "power_kw": 0, "clear": 1}
     payload = json.dumps(body).encode("utf-8")
-    coap_put(uri, payload)
+    coap_writer.submit(ugrid_id, ("obj", battery_index), uri, payload, PRIO_SAFETY)
 
 # ---------------------------------------------------------------------------
 # DECODIFICA /dev/state (JSON o CBOR)
@@ -267,9 +581,19 @@ def _decode_state_from_cbor(obj: Any) -> Dict[str, Any]:
             "H": (H_c or 0) / 100.0,
             "state": st_map.get(int(st), str(st)),
         })
-    return {
+    out = {
         "cnt": cnt, "load_kw": load_kw, "pv_kw": pv_kw, "bats": bats,
     }
+    flex_raw = obj.get(4)
+    if isinstance(flex_raw, (list, tuple)) and len(flex_raw) >= 3:
+        out["flex"] = {
+            "p_min": (flex_raw[0] or 0) / 100.0,
+            "p_max": (flex_raw[1] or 0) / 100.0,
+            "energy_kwh": (flex_raw[2] or 0) / 100.0,
+        }
+    if 5 in obj:
+        out["pv_curtailed_kw"] = (obj.get(5) or 0) / 100.0
+    return out
 
 def decode_ugrid_state(payload: bytes, content_format: Optional[int]) -> Dict[str, Any]:
     if content_format == CONTENT_FORMAT_CBOR:
@@ -289,6 +613,330 @@ def decode_ugrid_state(payload: bytes, content_format: Optional[int]) -> Dict[st
                 pass
         raise ValueError("Impossibile decodificare stato (ne JSON ne CBOR valido)")
 
+def decode_node_stats(payload: bytes) -> Dict[str, Any]:
+    # formato compatto di /dev/stats (vedi includes/coap_stats.h)
+    obj = cbor2.loads(payload)
+    tx = obj.get(1, [])
+    obs = obj.get(2, [])
+    out = {
+        "uptime_s": obj.get(0),
+        "requests": dict(zip(("sent", "ok", "error", "timeouts", "timeouts_x_retx"), tx)),
+        "observe": dict(zip(("notify_sent", "notify_rcvd", "notify_dup", "reg_ok", "reg_fail",
+                             "stale", "reregistrations"), obs)),
+        "resources": {
+            name: dict(zip(("requests", "bytes_in", "bytes_out"), vals))
+            for name, vals in zip(STATS_RESOURCES, obj.get(3, []))
+        },
+    }
+    if 4 in obj:
+        out["cycle"] = dict(zip(("cycles", "overruns", "skipped", "late_starts",
+                                 "last_ms", "max_ms", "degrade_level"), obj[4]))
+    return out
+
+# ---------------------------------------------------------------------------
+# RILEVAMENTO ANOMALIE (streaming)
+# ---------------------------------------------------------------------------
+
+class Ewma:
+    def __init__(self, alpha: float):
+        self.alpha = alpha
+        self.mean: Optional[float] = None
+        self.var = 0.0
+        self.n = 0
+
+    def zscore(self, x: float) -> float:
+        # z-score rispetto alla distribuzione vista finora (prima dell'update)
+        if self.mean is None or self.var <= 1e-12:
+            return 0.0
+        return (x - self.mean) / (self.var ** 0.5)
+
+    def update(self, x: float):
+        self.n += 1
+        if self.mean is None:
+            self.mean = x
+            return
+        d = x - self.mean
+        self.mean += self.alpha * d
+        self.var = (1.0 - self.alpha) * (self.var + self.alpha * d * d)
+
+
+class BatteryAnomalyDetector:
+    """
+    Detector incrementali per una batteria: pendenza di temperatura
+    (z-score EWMA), deriva dell'errore di tracking p - u* e pendenza SoH.
+    Gli alert sono a fronte: uno per episodio, riarmati al rientro.
+    """
+
+    def __init__(self):
+        self.last_ts: Optional[float] = None
+        self.last_temp: Optional[float] = None
+        self.last_soh: Optional[float] = None
+        self.temp_rate = Ewma(ANOMALY_EWMA_ALPHA)
+        self.tracking = Ewma(ANOMALY_DRIFT_ALPHA)
+        self.soh_slope = Ewma(ANOMALY_EWMA_ALPHA)
+        self.active = {"temp_rise": False, "tracking_drift": False, "soh_slope": False}
+
+    def _edge(self, name: str, cond: bool) -> bool:
+        fired = cond and not self.active[name]
+        self.active[name] = cond
+        return fired
+
+    def update(self, ts: float, temp: Optional[float], soh: Optional[float],
+               power_kw: Optional[float], optimal_u_kw: Optional[float],
+               track: bool) -> list:
+        out = []
+        dt = None if self.last_ts is None else ts - self.last_ts
+        self.last_ts = ts
+        if dt is not None and dt <= 0:
+            return out
+
+        if temp is not None:
+            if dt is not None and self.last_temp is not None:
+                rate = (temp - self.last_temp) / (dt / 60.0)  # °C/min
+                z = self.temp_rate.zscore(rate)
+                warm = self.temp_rate.n >= ANOMALY_WARMUP_SAMPLES
+                cond = warm and rate > TEMP_RISE_MIN_C_PER_MIN and z > ANOMALY_Z_THRESHOLD
+                if self._edge("temp_rise", cond):
+                    out.append(("warning", f"Salita temperatura anomala {rate:.2f}°C/min (z={z:.1f})",
+                                {"temp": temp, "rate_c_per_min": rate, "z": z}))
+                self.temp_rate.update(rate)
+            self.last_temp = temp
+
+        # la deriva ha senso solo quando la batteria segue l'MPC
+        if track and power_kw is not None and optimal_u_kw is not None:
+            self.tracking.update(power_kw - optimal_u_kw)
+            bias = self.tracking.mean
+            warm = self.tracking.n >= ANOMALY_WARMUP_SAMPLES
+            if self._edge("tracking_drift", warm and abs(bias) > TRACKING_DRIFT_KW):
+                out.append(("warning", f"Deriva tracking potenza {bias:+.2f} kW",
+                            {"bias_kw": bias, "power_kw": power_kw, "optimal_u_kw": optimal_u_kw}))
+
+        if soh is not None:
+            if dt is not None and self.last_soh is not None:
+                self.soh_slope.update((soh - self.last_soh) / (dt / 3600.0))
+                slope = self.soh_slope.mean
+                warm = self.soh_slope.n >= ANOMALY_WARMUP_SAMPLES
+                if self._edge("soh_slope", warm and slope < SOH_SLOPE_ALERT_PER_H):
+                    out.append(("warning", f"Degrado SoH rapido {slope*100:.2f}%/h",
+                                {"soh": soh, "slope_per_h": slope}))
+            self.last_soh = soh
+
+        return out
+
+# ---------------------------------------------------------------------------
+# DIGITAL TWIN (numpy, un batch per poll)
+# ---------------------------------------------------------------------------
+
+class BatteryTwinBank:
+    """
+    Gemello elettro-termico di tutte le batterie: lo stesso modello di
+    update_sensors_and_buffer() (battery_physics.h, senza rumore) avanzato
+    come operazioni numpy su array indicizzati per slot, alimentato dai
+    setpoint comandati. Ad ogni poll predice SoC/temperatura, confronta con
+    le misure, segnala i sensori discordanti e riassimila le misure; le
+    batterie senza misura proseguono in anello aperto (gap riempito).
+    """
+
+    FIELDS = ("soc", "temp", "soh", "u_kw", "meas_soc", "meas_temp",
+              "meas_soh", "err_soc", "err_temp")
+
+    def __init__(self, constants: dict, capacity: int = 64):
+        self.k = constants  # da battery_physics.h, vedi battery_twin.load_constants()
+        self.lock = threading.Lock()
+        self.slots: Dict[Tuple[str, int], int] = {}
+        self.keys: list = []
+        self.n = 0
+        self.a = {f: np.zeros(capacity) for f in self.FIELDS}
+        self.running = np.zeros(capacity, dtype=bool)
+        self.has_meas = np.zeros(capacity, dtype=bool)
+        self.bad = np.zeros(capacity, dtype=np.int32)
+        self.gap = np.zeros(capacity, dtype=np.int32)
+        self.last_step_ms = 0.0
+
+    def _slot(self, key: Tuple[str, int]) -> int:
+        i = self.slots.get(key)
+        if i is not None:
+            return i
+        if self.n == len(self.running):
+            cap = 2 * self.n
+            for f in self.FIELDS:
+                self.a[f] = np.resize(self.a[f], cap)
+            self.running = np.resize(self.running, cap)
+            self.has_meas = np.resize(self.has_meas, cap)
+            self.bad = np.resize(self.bad, cap)
+            self.gap = np.resize(self.gap, cap)
+        i = self.slots[key] = self.n
+        self.keys.append(key)
+        self.n += 1
+        self.bad[i] = 0
+        self.gap[i] = 0
+        self.a["soc"][i] = np.nan      # inizializzato dalla prima misura
+        return i
+
+    def observe(self, ugrid_id: str, bats: list):
+        # misure e setpoint di un uGrid: solo assegnazioni, il modello gira in step()
+        rows, soc, temp, soh, u, run = [], [], [], [], [], []
+        for b in bats:
+            if b.get("S") is None or b.get("T") is None:
+                continue
+            rows.append(int(b.get("idx", 0)))
+            soc.append(b["S"]); temp.append(b["T"]); soh.append(b.get("H") or 1.0)
+            u.append(b.get("u") or 0.0); run.append(b.get("state") == "RUN")
+        with self.lock:
+            r = np.fromiter((self._slot((ugrid_id, i)) for i in rows), dtype=np.intp, count=len(rows))
+            a = self.a
+            a["meas_soc"][r] = soc
+            a["meas_temp"][r] = temp
+            a["meas_soh"][r] = soh
+            a["u_kw"][r] = u
+            self.running[r] = run
+            self.has_meas[r] = True
+            # prima misura: il gemello parte dallo stato osservato
+            new = r[np.isnan(a["soc"][r])]
+            a["soc"][new] = a["meas_soc"][new]
+            a["temp"][new] = a["meas_temp"][new]
+            a["soh"][new] = a["meas_soh"][new]
+
+    def _physics(self, soc, temp, soh, power_w, dt):
+        p = battery_twin.derate_power(self.k, soc, power_w)
+        return battery_twin.physics_step(self.k, soc, temp, soh, p, dt)
+
+    def step(self, elapsed_sec: float) -> list:
+        """Predice, confronta e riassimila; ritorna le discordanze nuove."""
+        t0 = time.perf_counter()
+        with self.lock:
+            n = self.n
+            if n == 0:
+                return []
+            a = self.a
+            soc, temp, soh = a["soc"][:n], a["temp"][:n], a["soh"][:n]
+            power_w = np.where(self.running[:n], a["u_kw"][:n] * 1000.0, 0.0)
+
+            steps = max(1, int(round(elapsed_sec / TWIN_NODE_PERIOD_SEC)))
+            for _ in range(steps):
+                soc, temp = self._physics(soc, temp, soh, power_w, TWIN_STEP_DT)
+
+            m = self.has_meas[:n]
+            err_soc = np.where(m, a["meas_soc"][:n] - soc, 0.0)
+            err_temp = np.where(m, a["meas_temp"][:n] - temp, 0.0)
+            disagree = m & ((np.abs(err_soc) > TWIN_SOC_TOL) | (np.abs(err_temp) > TWIN_TEMP_TOL_C))
+            self.bad[:n] = np.where(disagree, self.bad[:n] + 1, np.where(m, 0, self.bad[:n]))
+            self.gap[:n] = np.where(m, 0, self.gap[:n] + 1)
+
+            # predittore a un passo: si riparte dalla misura se concorda;
+            # una misura discordante non viene assimilata finche' non scatta
+            # l'alert, poi il gemello si riallinea (es. reset del nodo)
+            sync = (m & ~disagree) | (self.bad[:n] >= TWIN_DISAGREE_POLLS)
+            a["soc"][:n] = np.where(sync, a["meas_soc"][:n], soc)
+            a["temp"][:n] = np.where(sync, a["meas_temp"][:n], temp)
+            a["soh"][:n] = np.where(m, a["meas_soh"][:n], soh)
+            a["err_soc"][:n] = err_soc
+            a["err_temp"][:n] = err_temp
+            self.has_meas[:n] = False
+
+            # alert a fronte: uno per episodio
+            fired = np.nonzero(self.bad[:n] == TWIN_DISAGREE_POLLS)[0]
+            out = [(self.keys[i], float(err_soc[i]), float(err_temp[i])) for i in fired]
+            self.last_step_ms = (time.perf_counter() - t0) * 1000.0
+        return out
+
+    def snapshot(self) -> list:
+        with self.lock:
+            n = self.n
+            a = self.a
+            return [{
+                "ugrid_id": ug, "battery_index": idx,
+                "soc": round(float(a["soc"][i]), 4), "temperature": round(float(a["temp"][i]), 2),
+                "err_soc": round(float(a["err_soc"][i]), 4), "err_temp": round(float(a["err_temp"][i]), 2),
+                "gap_polls": int(self.gap[i]),
+                "disagree": bool(self.bad[i] >= TWIN_DISAGREE_POLLS),
+                "source": "twin" if self.gap[i] > 0 else "measured",
+            } for i, (ug, idx) in enumerate(self.keys[:n])]
+
+    def metrics(self) -> Dict[str, Any]:
+        with self.lock:
+            return {"batteries": self.n, "last_step_ms": round(self.last_step_ms, 3),
+                    "gaps": int(np.count_nonzero(self.gap[:self.n])),
+                    "disagree": int(np.count_nonzero(self.bad[:self.n] >= TWIN_DISAGREE_POLLS))}
+
+# ---------------------------------------------------------------------------
+# DOWNSAMPLING (Largest-Triangle-Three-Buckets)
+# ---------------------------------------------------------------------------
+
+class LttbDownsampler:
+    """
+    LTTB in streaming: conoscendo il numero totale di righe, tiene in memoria
+    solo il bucket corrente e quello successivo (di cui serve la media).
+    push() restituisce le righe selezionate appena sono decidibili.
+    """
+
+    def __init__(self, n_total: int, n_out: int, y_key: str):
+        self.n_total = n_total
+        self.n_out = n_out
+        self.y_key = y_key
+        self.i = 0
+        self.prev = None           # ultimo punto selezionato (x, y)
+        self.cur: list = []
+        self.nxt: list = []
+        self.nxt_bucket = -1
+
+    def _xy(self, row) -> Tuple[float, float]:
+        y = row.get(self.y_key)
+        return row["ts"].timestamp(), float(y) if y is not None else 0.0
+
+    def _select(self, bucket: list, avg: Tuple[float, float]):
+        ax, ay = self.prev
+        cx, cy = avg
+        best, best_area = None, -1.0
+        for row in bucket:
+            bx, by = self._xy(row)
+            area = abs((ax - cx) * (by - ay) - (ax - bx) * (cy - ay))
+            if area > best_area:
+                best, best_area = row, area
+        self.prev = self._xy(best)
+        return best
+
+    def _avg(self, bucket: list) -> Tuple[float, float]:
+        xs = ys = 0.0
+        for row in bucket:
+            x, y = self._xy(row)
+            xs += x
+            ys += y
+        return xs / len(bucket), ys / len(bucket)
+
+    def push(self, row) -> list:
+        i = self.i
+        self.i += 1
+        if i == 0:
+            self.prev = self._xy(row)
+            return [row]
+        if i == self.n_total - 1:
+            return self.finish(last=row)
+
+        bucket = (i - 1) * (self.n_out - 2) // (self.n_total - 2)
+        out = []
+        if bucket != self.nxt_bucket:
+            # il bucket "successivo" e' completo: si decide quello corrente
+            if self.cur:
+                out.append(self._select(self.cur, self._avg(self.nxt)))
+            self.cur = self.nxt
+            self.nxt, self.nxt_bucket = [], bucket
+        self.nxt.append(row)
+        return out
+
+    def finish(self, last=None) -> list:
+        out = []
+        tail = self._xy(last) if last is not None else None
+        if self.cur:
+            avg = self._avg(self.nxt) if self.nxt else tail
+            out.append(self._select(self.cur, avg))
+        if self.nxt:
+            out.append(self._select(self.nxt, tail if tail else self._avg(self.nxt)))
+        self.cur, self.nxt = [], []
+        if last is not None:
+            out.append(last)
+        return out
+
 # ---------------------------------------------------------------------------
 # MQTT 
 # ---------------------------------------------------------------------------
@@ -344,6 +992,53 @@ class MqttPublisher:
         except Exception as e:
             logger.error(f"Errore pubblicando alert MQTT: {e}")
 
+class MqttStateSubscriber:
+    # ingestion dello stato dei uGrid in modalita' push: niente poll per sito
+    def __init__(self, host: str, port: int, on_state):
+        self.host = host
+        self.port = port
+        self.on_state = on_state
+        self.client = mqtt.Client()
+        self.client.on_connect = self.on_connect
+        self.client.on_message = self.on_message
+        self.received = 0
+        self.dropped = 0
+
+    def start(self):
+        try:
+            self.client.connect(self.host, self.port, keepalive=60)
+            self.client.loop_start()
+        except Exception as e:
+            logger.error(f"Errore connessione MQTT (stato): {e}")
+
+    def stop(self):
+        try:
+            self.client.loop_stop()
+            self.client.disconnect()
+        except Exception:
+            pass
+
+    def on_connect(self, client, userdata, flags, rc):
+        if rc == 0:
+            # ri-sottoscrizione ad ogni riconnessione
+            client.subscribe(f"{MQTT_STATE_TOPIC_BASE}/+", qos=0)
+            logger.info(f"Sottoscritto a {MQTT_STATE_TOPIC_BASE}/+")
+        else:
+            logger.error(f"Connessione MQTT (stato) fallita, rc={rc}")
+
+    def on_message(self, client, userdata, msg):
+        ugrid_id = msg.topic.rsplit("/", 1)[-1]
+        if UGRIDS.get(ugrid_id, {}).get("uplink") != "mqtt":
+            self.dropped += 1
+            return
+        try:
+            state = decode_ugrid_state(msg.payload, CONTENT_FORMAT_CBOR)
+            self.on_state(ugrid_id, state)
+            self.received += 1
+        except Exception as e:
+            self.dropped += 1
+            logger.error(f"Errore stato MQTT {ugrid_id}: {e}")
+
 # ---------------------------------------------------------------------------
 # CORE RCA
 # ---------------------------------------------------------------------------
@@ -352,32 +1047,113 @@ class RCA:
     def __init__(self):
         self.stop_event = threading.Event()
         self.mqtt_pub = MqttPublisher(MQTT_BROKER_HOST, MQTT_BROKER_PORT)
+        self.mqtt_state = MqttStateSubscriber(MQTT_BROKER_HOST, MQTT_BROKER_PORT, self.ingest_state)
+        # poll loop e subscriber MQTT ingeriscono in parallelo: uno stato alla volta
+        self.ingest_lock = threading.Lock()
+        self.last_state_t: Dict[str, float] = {}
         self.db_lock = threading.Lock()
         self.logger = logger
         self.ugrid_price: Dict[str, float] = {
             ugrid_id: ENERGY_PRICE_EUR_PER_KWH for ugrid_id in UGRIDS.keys()
         }
         self.latest_batt_extra: Dict[Tuple[str, int], Dict[str, Any]] = {}
+        self.anomaly: Dict[Tuple[str, int], BatteryAnomalyDetector] = {}
+        # statistiche di trasporto CoAP raccolte da /dev/stats
+        self.node_stats: Dict[str, Dict[str, Any]] = {}
+        self.last_stats_t = 0.0
+        # ultimo aggregato di flessibilita' per uGrid (modalita' gerarchica)
+        self.ugrid_flex: Dict[str, Dict[str, Any]] = {}
+        # gemello digitale delle batterie (se numpy e' disponibile)
+        self.twin = None
+        if TWIN_ENABLED and np is not None:
+            try:
+                self.twin = BatteryTwinBank(battery_twin.load_constants())
+            except (OSError, ValueError) as e:
+                logger.error("Digital twin disabilitato: %s", e)
+        self.last_twin_t = time.time()
+
+        # ultima riga di telemetria per batteria: /api/status la legge da qui
+        # invece di rifare il join sull'intera tabella
+        self.cache_lock = threading.Lock()
+        self.latest_rows: Dict[Tuple[str, int], Dict[str, Any]] = {}
+        self.last_telemetry_id = 0
+        self.warm = False
+
+        # obiettivi e parametri MPC in memoria, caricati all'avvio e
+        # aggiornati write-through dalle API: il poll non legge piu' il DB
+        self.objectives: Dict[str, Dict[int, Tuple[str, Optional[float]]]] = {
+            ugrid_id: {} for ugrid_id in UGRIDS.keys()
+        }
+        self.mpc_params: Dict[str, Dict[str, Any]] = {}
+        self.last_snapshot_t = 0.0
+
+        # versione dello stato servito da /api/status: incrementata ad ogni
+        # ingestion o modifica di obiettivi/parametri, usata come ETag
+        self.boot_id = uuid.uuid4().hex[:8]
+        self.state_version = 0
+        self.version_lock = threading.Lock()
+        self.status_cache: Optional[Tuple[int, bytes]] = None
+
+    # --- Versioning stato ------------------------------------------
+    def bump_version(self):
+        with self.version_lock:
+            self.state_version += 1
+
+    def status_etag(self) -> str:
+        return f'"{self.boot_id}-{self.state_version}"'
+
+    def get_latest_status_json(self) -> Tuple[str, bytes]:
+        # serializza solo se la versione e' cambiata dall'ultima richiesta
+        with self.version_lock:
+            version = self.state_version
+            cached = self.status_cache
+        if cached is not None and cached[0] == version:
+            return f'"{self.boot_id}-{version}"', cached[1]
+
+        body = json.dumps(self.get_latest_status(), separators=(",", ":")).encode("utf-8")
+        with self.version_lock:
+            # se nel frattempo e' arrivato un nuovo poll non cachiamo dati vecchi
+            if self.state_version == version:
+                self.status_cache = (version, body)
+        return f'"{self.boot_id}-{version}"', body
 
     # --- DB Helpers ------------------------------------------------
-    def insert_telemetry(self, ugrid_id, battery_index, row):
+    def insert_poll(self, ugrid_id, site, rows):
+        # un poll = una riga di sito + una riga per batteria, una transazione
         with self.db_lock:
             conn = get_mysql_connection(DB_NAME)
             try:
                 cur = conn.cursor()
                 cur.execute("""
-                    INSERT INTO telemetry (
-                        ugrid_id, battery_index, soc, soh, voltage, temperature,
-                        current, power_kw, optimal_u_kw, grid_power_kw,
-                        load_kw, pv_kw, profit_eur
-                    ) VALUES (%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s)
-                """, (ugrid_id, battery_index, row.get("soc"), row.get("soh"), row.get("voltage"),
-                      row.get("temperature"), row.get("current"), row.get("power_kw"), row.get("optimal_u_kw"),
-                      row.get("grid_power_kw"), row.get("load_kw"), row.get("pv_kw"), row.get("profit_eur")))
+                    INSERT INTO site_telemetry (ugrid_id, load_kw, pv_kw, grid_power_kw, pv_curtailed_kw)
+                    VALUES (%s,%s,%s,%s,%s)
+                """, (ugrid_id, site.get("load_kw"), site.get("pv_kw"), site.get("grid_power_kw"),
+                      site.get("pv_curtailed_kw")))
+                poll_id = cur.lastrowid
+                row_ids = []
+                for battery_index, row in rows:
+                    cur.execute("""
+                        INSERT INTO telemetry (
+                            ugrid_id, battery_index, soc, soh, voltage, temperature,
+                            current, power_kw, optimal_u_kw, profit_eur, poll_id
+                        ) VALUES (%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s)
+                    """, (ugrid_id, battery_index, row.get("soc"), row.get("soh"), row.get("voltage"),
+                          row.get("temperature"), row.get("current"), row.get("power_kw"),
+                          row.get("optimal_u_kw"), row.get("profit_eur"), poll_id))
+                    row_ids.append(cur.lastrowid)
                 conn.commit()
             finally:
                 conn.close()
 
+        now = datetime.now()
+        with self.cache_lock:
+            for (battery_index, row), row_id in zip(rows, row_ids):
+                self.latest_rows[(ugrid_id, battery_index)] = dict(
+                    row, id=row_id, ugrid_id=ugrid_id, battery_index=battery_index, ts=now,
+                    poll_id=poll_id, load_kw=site.get("load_kw"), pv_kw=site.get("pv_kw"),
+                    grid_power_kw=site.get("grid_power_kw"))
+                self.last_telemetry_id = max(self.last_telemetry_id, row_id or 0)
+
     def insert_alert(self, level, ugrid_id, battery_index, message, payload):
         with self.db_lock:
             conn = get_mysql_connection(DB_NAME)
@@ -405,6 +1181,10 @@ class RCA:
                 conn.commit()
             finally:
                 conn.close()
+        with self.cache_lock:
+            self.objectives.setdefault(ugrid_id, {})[battery_index] = (
+                mode, float(target_soc) if target_soc is not None else None)
+        self.bump_version()
 
     def delete_objective(self, ugrid_id, battery_index):
         with self.db_lock:
@@ -416,37 +1196,64 @@ class RCA:
                 conn.commit()
             finally:
                 conn.close()
+        with self.cache_lock:
+            self.objectives.get(ugrid_id, {}).pop(battery_index, None)
+        self.bump_version()
 
     def get_objectives_for_ugrid(self, ugrid_id):
+        with self.cache_lock:
+            return dict(self.objectives.get(ugrid_id, {}))
+
+    def get_mpc_params(self, ugrid_id):
+        with self.cache_lock:
+            row = self.mpc_params.get(ugrid_id)
+            return dict(row) if row else None
+
+    def load_config(self):
+        # unica lettura di obiettivi e parametri: da qui in poi li aggiornano le API
         with self.db_lock:
             conn = get_mysql_connection(DB_NAME)
             try:
-                cur = conn.cursor()
-                cur.execute("SELECT battery_index, mode, target_soc FROM objectives WHERE ugrid_id=%s", (ugrid_id,))
-                rows = cur.fetchall()
+                cur = conn.cursor(dictionary=True)
+                cur.execute("SELECT ugrid_id, battery_index, mode, target_soc FROM objectives")
+                objectives = cur.fetchall()
+                cur.execute("SELECT * FROM mpc_params")
+                params = cur.fetchall()
             finally:
                 conn.close()
-        out = {}
-        for idx, mode, target_soc in rows:
-            out[int(idx)] = (mode, float(target_soc) if target_soc is not None else None)
-        return out
 
-    def get_latest_status(self):
-        # (Logica identica all'originale per aggregare dati DB)
+        with self.cache_lock:
+            for r in objectives:
+                if r["ugrid_id"] not in UGRIDS: continue
+                tgt = r["target_soc"]
+                self.objectives[r["ugrid_id"]][int(r["battery_index"])] = (
+                    r["mode"], float(tgt) if tgt is not None else None)
+            for r in params:
+                if r["ugrid_id"] not in UGRIDS: continue
+                self.mpc_params[r["ugrid_id"]] = r
+                self.ugrid_price[r["ugrid_id"]] = float(r["price"])
+
+    def _query_latest_rows(self):
         with self.db_lock:
             conn = get_mysql_connection(DB_NAME)
             try:
                 cur = conn.cursor(dictionary=True)
-                cur.execute("""
-                    SELECT t.* FROM telemetry t
+                cur.execute(TELEMETRY_SELECT + """
                     JOIN (SELECT ugrid_id, battery_index, MAX(ts) AS ts FROM telemetry GROUP BY ugrid_id, battery_index) last
                     ON t.ugrid_id = last.ugrid_id AND t.battery_index = last.battery_index AND t.ts = last.ts
                     ORDER BY t.ugrid_id, t.battery_index
                 """)
-                rows = cur.fetchall()
+                return cur.fetchall()
             finally:
                 conn.close()
 
+    def get_latest_status(self):
+        if self.warm:
+            with self.cache_lock:
+                rows = [self.latest_rows[k] for k in sorted(self.latest_rows)]
+        else:
+            rows = self._query_latest_rows()
+
         res = {}
         profit_totals = {}
         objectives_all = {ug: self.get_objectives_for_ugrid(ug) for ug in UGRIDS.keys()}
@@ -540,7 +1347,7 @@ class RCA:
         # DETACH
         if mode == "detach":
             try:
-                send_ugrid_objective(ugrid_id, battery_index, 0.0)
+                send_ugrid_objective(ugrid_id, battery_index, 0.0, PRIO_SAFETY)
             except Exception: pass
             self.delete_objective(ugrid_id, battery_index)
             self.insert_alert("info", ugrid_id, battery_index, "Batteria staccata (detach)", {})
@@ -563,15 +1370,21 @@ class RCA:
         if grid_power_kw is not None and dt_hours > 0:
             profit_eur_total = -price * grid_power_kw * dt_hours
         
+        flex = state.get("flex")
+        if flex is not None and load_kw is not None and pv_kw is not None:
+            self.ugrid_flex[ugrid_id] = dict(flex, net_kw=load_kw - pv_kw, ts=time.time())
+
+        if self.twin is not None:
+            self.twin.observe(ugrid_id, bats)
+
         total_abs_power = sum(abs(b.get("p", 0.0) or 0.0) for b in bats) or 1.0
         objectives = self.get_objectives_for_ugrid(ugrid_id)
+        now = time.time()
 
+        rows = []
         for b in bats:
             idx = int(b.get("idx", 0))
             power_kw = b.get("p")
-            soc = b.get("S")
-            soh = b.get("H")
-            temp = b.get("T")
             
             self.latest_batt_extra[(ugrid_id, idx)] = {
                 "state": b.get("state"), "ip": b.get("ip")
@@ -581,13 +1394,22 @@ class RCA:
             if profit_eur_total is not None and power_kw is not None:
                  profit_eur = profit_eur_total * (abs(power_kw) / total_abs_power)
 
-            row = {
-                "soc": soc, "soh": soh, "voltage": b.get("V"), "temperature": temp,
+            rows.append((idx, {
+                "soc": b.get("S"), "soh": b.get("H"), "voltage": b.get("V"), "temperature": b.get("T"),
                 "current": b.get("I"), "power_kw": power_kw, "optimal_u_kw": b.get("u"),
-                "grid_power_kw": grid_power_kw, "load_kw": load_kw, "pv_kw": pv_kw,
                 "profit_eur": profit_eur
-            }
-            self.insert_telemetry(ugrid_id, idx, row)
+            }))
+
+        site = {"load_kw": load_kw, "pv_kw": pv_kw, "grid_power_kw": grid_power_kw,
+                "pv_curtailed_kw": state.get("pv_curtailed_kw")}
+        self.insert_poll(ugrid_id, site, rows)
+
+        for b in bats:
+            idx = int(b.get("idx", 0))
+            power_kw = b.get("p")
+            soc = b.get("S")
+            soh = b.get("H")
+            temp = b.get("T")
 
             # Alerts
             if soh is not None and soh < SOH_LOW_CRITICAL:
@@ -597,35 +1419,180 @@ class RCA:
             if soc is not None and soc < SOC_LOW_WARNING:
                 self.insert_alert("warning", ugrid_id, idx, f"SoC basso {soc*100:.1f}%", {"soc": soc})
 
+            det = self.anomaly.get((ugrid_id, idx))
+            if det is None:
+                det = self.anomaly[(ugrid_id, idx)] = BatteryAnomalyDetector()
+            track = idx not in objectives and b.get("state") == "RUN"
+            for level, msg, data in det.update(now, temp, soh, power_kw, b.get("u"), track):
+                self.insert_alert(level, ugrid_id, idx, msg, data)
+
             if idx in objectives:
                 self.apply_objective(ugrid_id, idx, b, objectives[idx])
 
+        self.bump_version()
+
+    def collect_node_stats(self):
+        self.last_stats_t = time.time()
+        for ugrid_id in UGRIDS.keys():
+            try:
+                payload, _ = coap_get(ugrid_ctrl_uri(ugrid_id, "dev/stats"), timeout=3.0)
+                self.node_stats[ugrid_id] = dict(decode_node_stats(payload), ts=time.time())
+            except Exception as e:
+                logger.error(f"Errore lettura /dev/stats {ugrid_id}: {e}")
+
+    # --- Digital twin ------------------------------------------------
+    def step_twin(self):
+        # un solo batch per giro di poll, anche per i uGrid che non hanno risposto
+        now = time.time()
+        elapsed = now - self.last_twin_t
+        self.last_twin_t = now
+        for (ug, idx), err_soc, err_temp in self.twin.step(elapsed):
+            self.insert_alert("warning", ug, idx,
+                              f"Sensori discordanti dal gemello: SoC {err_soc*100:+.1f}%, T {err_temp:+.1f}°C",
+                              {"err_soc": err_soc, "err_temp": err_temp})
+
+    # --- Coordinatore (modalita' gerarchica) ------------------------
+    def coordinate_ugrids(self):
+        # ogni uGrid esporta solo [p_min, p_max, energia] e riceve un setpoint
+        # di flotta: il lavoro per controller non dipende dalla taglia del sito
+        now = time.time()
+        flexes = {ug: f for ug, f in self.ugrid_flex.items()
+                  if now - f["ts"] <= COORD_FLEX_MAX_AGE_SEC}
+        if not flexes:
+            return
+
+        # le batterie del sito coprono il carico netto complessivo
+        target = -sum(f["net_kw"] for f in flexes.values())
+        target = max(sum(f["p_min"] for f in flexes.values()),
+                     min(sum(f["p_max"] for f in flexes.values()), target))
+
+        # ripartizione proporzionale al margine nella direzione richiesta
+        if target >= 0:
+            weights = {ug: max(f["p_max"], 0.0) for ug, f in flexes.items()}
+        else:
+            weights = {ug: max(-f["p_min"], 0.0) for ug, f in flexes.items()}
+        total_w = sum(weights.values())
+
+        for ug, w in weights.items():
+            sp = target * w / total_w if total_w > 0 else 0.0
+            send_ugrid_setpoint(ug, sp, COORD_SETPOINT_TTL_SEC)
+
+    # --- Snapshot / rehydration ------------------------------------
+    def save_snapshot(self):
+        with self.cache_lock:
+            rows = [dict(r, ts=r["ts"].isoformat()) for r in self.latest_rows.values()]
+            last_id = self.last_telemetry_id
+        snap = {
+            "saved_at": time.time(),
+            "last_telemetry_id": last_id,
+            "latest_batt_extra": [[ug, idx, extra] for (ug, idx), extra in self.latest_batt_extra.items()],
+            "latest_rows": rows,
+        }
+        # scrittura atomica: un crash a meta' non lascia uno snapshot troncato
+        tmp = SNAPSHOT_PATH + ".tmp"
+        with open(tmp, "w") as f:
+            json.dump(snap, f, separators=(",", ":"))
+        os.replace(tmp, SNAPSHOT_PATH)
+        self.last_snapshot_t = time.time()
+
+    def load_snapshot(self) -> bool:
+        try:
+            with open(SNAPSHOT_PATH) as f:
+                snap = json.load(f)
+        except FileNotFoundError:
+            return False
+        except Exception as e:
+            logger.warning(f"Snapshot illeggibile, ignorato: {e}")
+            return False
+
+        # i prezzi non stanno nello snapshot: fa fede mpc_params (load_config),
+        # una copia qui riporterebbe indietro un prezzo cambiato dopo lo snapshot
+        for ug, idx, extra in snap.get("latest_batt_extra", []):
+            self.latest_batt_extra[(ug, int(idx))] = extra
+        with self.cache_lock:
+            for r in snap.get("latest_rows", []):
+                r["ts"] = datetime.fromisoformat(r["ts"])
+                self.latest_rows[(r["ugrid_id"], int(r["battery_index"]))] = r
+            self.last_telemetry_id = int(snap.get("last_telemetry_id", 0))
+        return True
+
+    def rehydrate(self):
+        # 1) snapshot locale (se presente), altrimenti un solo join all'avvio
+        # 2) coda della telemetria scritta dopo lo snapshot (scan su PK)
+        t0 = time.time()
+        self.load_config()
+        if self.load_snapshot():
+            with self.db_lock:
+                conn = get_mysql_connection(DB_NAME)
+                try:
+                    cur = conn.cursor(dictionary=True)
+                    cur.execute(TELEMETRY_SELECT + " WHERE t.id > %s ORDER BY t.id", (self.last_telemetry_id,))
+                    tail = cur.fetchall()
+                finally:
+                    conn.close()
+            source = "snapshot"
+        else:
+            tail = self._query_latest_rows()
+            source = "db"
+
+        with self.cache_lock:
+            for r in tail:
+                self.latest_rows[(r["ugrid_id"], int(r["battery_index"]))] = r
+                self.last_telemetry_id = max(self.last_telemetry_id, int(r["id"]))
+
+        self.warm = True
+        self.bump_version()
+        logger.info(f"Stato reidratato da {source}: {len(self.latest_rows)} batterie, "
+                    f"{len(tail)} righe di coda in {time.time() - t0:.3f}s")
+
+    def ingest_state(self, ugrid_id, state):
+        # Normalizzazione numerica
+        if isinstance(state.get("load_kw"), str): state["load_kw"] = float(state["load_kw"])
+        if isinstance(state.get("pv_kw"), str): state["pv_kw"] = float(state["pv_kw"])
+
+        with self.ingest_lock:
+            now = time.time()
+            dt = (now - self.last_state_t.get(ugrid_id, now)) / 3600.0
+            self.last_state_t[ugrid_id] = now
+            self._handle_ugrid_state(ugrid_id, state, max(dt, POLL_INTERVAL_SEC/3600.0))
+
     def poll_loop(self):
         logger.info("Poll loop avviato (CoAPthon sync)")
-        last_ts = {ugrid_id: time.time() for ugrid_id in UGRIDS.keys()}
 
         while not self.stop_event.is_set():
             start_t = time.time()
             for ugrid_id, cfg in UGRIDS.items():
+                if cfg.get("uplink") == "mqtt": continue
                 uri = cfg["coap_state_uri"]
                 try:
                     # Chiamata sincrona, non c'è await
                     payload, cf = coap_get(uri, timeout=3.0)
-                    state = decode_ugrid_state(payload, cf)
-                    
-                    # Normalizzazione numerica
-                    if isinstance(state.get("load_kw"), str): state["load_kw"] = float(state["load_kw"])
-                    if isinstance(state.get("pv_kw"), str): state["pv_kw"] = float(state["pv_kw"])
-                    
-                    now = time.time()
-                    dt = (now - last_ts.get(ugrid_id, now)) / 3600.0
-                    last_ts[ugrid_id] = now
-                    
-                    self._handle_ugrid_state(ugrid_id, state, max(dt, POLL_INTERVAL_SEC/3600.0))
-                    
+                    self.ingest_state(ugrid_id, decode_ugrid_state(payload, cf))
                 except Exception as e:
                     logger.error(f"Errore poll ugrid {ugrid_id}: {e}")
 
+            if self.twin is not None:
+                try:
+                    with self.ingest_lock:
+                        self.step_twin()
+                except Exception as e:
+                    logger.error(f"Errore digital twin: {e}")
+
+            if time.time() - self.last_stats_t >= STATS_POLL_INTERVAL_SEC:
+                self.collect_node_stats()
+
+            if HIERARCHICAL_MODE:
+                try:
+                    self.coordinate_ugrids()
+                except Exception as e:
+                    logger.error(f"Errore coordinamento uGrid: {e}")
+
+            if time.time() - self.last_snapshot_t >= SNAPSHOT_INTERVAL_SEC:
+                try:
+                    self.save_snapshot()
+                except Exception as e:
+                    logger.error(f"Errore scrittura snapshot: {e}")
+
             elapsed = time.time() - start_t
             wait_for = max(0.0, POLL_INTERVAL_SEC - elapsed)
             # wait gestito con Event per uscire puliti se richiesto stop
@@ -649,6 +1616,12 @@ class RCA:
                 conn.commit()
             finally:
                 conn.close()
+        with self.cache_lock:
+            self.mpc_params[ugrid_id] = {
+                "ugrid_id": ugrid_id, "alpha": alpha, "beta": beta, "gamma": gamma,
+                "price": price, "updated_at": datetime.now(),
+            }
+        self.bump_version()
         
         # CoAP PUT
         uconf = UGRIDS.get(ugrid_id)
@@ -664,20 +1637,48 @@ class RCA:
             separators=(",", ":")
         ).encode("utf-8")
         
-        try:
-            coap_put(mpc_uri, payload, timeout=3.0)
-        except Exception as e:
-            logger.error(f"Errore set_mpc_params CoAP: {e}")
+        coap_writer.submit(ugrid_id, ("mpc",), mpc_uri, payload)
+
+    def set_peak_shaving(self, ugrid_id, enabled, weight):
+        # peak shaving sul uGrid: stato non persistito, il uGrid lo mantiene
+        if ugrid_id not in UGRIDS: return
+        payload = json.dumps(
+            {"en": 1 if enabled else 0, "w": int(round(weight * 100))},
+            separators=(",", ":")
+        ).encode("utf-8")
+        coap_writer.submit(ugrid_id, ("peak",), ugrid_ctrl_uri(ugrid_id, "ctrl/peak"), payload)
+
+    def set_export_cap(self, ugrid_id, cap_kw):
+        # limite di export del sito (None = nessun limite, 0 = immissione zero):
+        # il curtailment FV lo decide l'MPC sul uGrid
+        if ugrid_id not in UGRIDS: return
+        cap = -1 if cap_kw is None else int(round(cap_kw * 100))
+        payload = json.dumps({"cap": cap}, separators=(",", ":")).encode("utf-8")
+        coap_writer.submit(ugrid_id, ("pvcap",), ugrid_ctrl_uri(ugrid_id, "ctrl/pv"), payload)
 
     def start(self):
+        try:
+            self.rehydrate()
+        except Exception as e:
+            logger.error(f"Rehydration fallita, /api/status usera' il DB: {e}")
         self.mqtt_pub.start()
+        if any(cfg.get("uplink") == "mqtt" for cfg in UGRIDS.values()):
+            self.mqtt_state.start()
+        coap_writer.start()
         # Thread per il loop di polling (che ora usa chiamate bloccanti)
         t = threading.Thread(target=self.poll_loop, daemon=True)
         t.start()
 
     def stop(self):
         self.stop_event.set()
+        coap_writer.stop()
+        self.mqtt_state.stop()
         self.mqtt_pub.stop()
+        if self.warm:
+            try:
+                self.save_snapshot()
+            except Exception as e:
+                logger.error(f"Errore scrittura snapshot: {e}")
 
 rca = RCA()
 
@@ -685,9 +1686,54 @@ rca = RCA()
 # API HTTP (Flask)                                              
 # ---------------------------------------------------------------------------
 
+def _accepted_encoding() -> Optional[str]:
+    accept = request.accept_encodings
+    if brotli is not None and accept["br"]:
+        return "br"
+    if accept["gzip"]:
+        return "gzip"
+    return None
+
+@app.after_request
+def compress_response(response):
+    # compressione solo per le risposte voluminose (history, alert)
+    if not request.path.endswith(COMPRESS_PATH_SUFFIXES):
+        return response
+    if response.status_code != 200 or response.direct_passthrough:
+        return response
+    if "Content-Encoding" in response.headers:
+        return response
+
+    response.vary.add("Accept-Encoding")
+    data = response.get_data()
+    if len(data) < COMPRESS_MIN_BYTES:
+        return response
+
+    encoding = _accepted_encoding()
+    if encoding == "br":
+        data = brotli.compress(data, quality=5)
+    elif encoding == "gzip":
+        data = gzip.compress(data, compresslevel=6)
+    else:
+        return response
+
+    response.set_data(data)
+    response.headers["Content-Encoding"] = encoding
+    return response
+
 @app.route("/api/status", methods=["GET"])
 def api_status():
-    return jsonify(rca.get_latest_status())
+    # risposta condizionale: se il client ha gia' la versione corrente
+    # restituiamo 304 senza interrogare il DB ne serializzare
+    etag = rca.status_etag()
+    if etag.strip('"') in request.if_none_match:
+        return Response(status=304, headers={"ETag": etag})
+
+    etag, body = rca.get_latest_status_json()
+    resp = Response(body, mimetype="application/json")
+    resp.headers["ETag"] = etag
+    resp.headers["Cache-Control"] = "no-cache"
+    return resp
 
 @app.route("/api/batteries/<ugrid_id>/<int:bat_idx>/objective", methods=["POST", "DELETE"])
 def api_battery_objective(ugrid_id, bat_idx):
@@ -712,14 +1758,28 @@ def api_battery_objective(ugrid_id, bat_idx):
     rca.upsert_objective(ugrid_id, bat_idx, mode, target_soc)
     return jsonify({"status": "ok", "mode": mode})
 
+def _int_arg(name, default, lo, hi):
+    # parametro intero di query: 400 se non numerico, poi limitato a [lo, hi]
+    raw = request.args.get(name)
+    if raw is None: return default
+    try:
+        value = int(raw)
+    except ValueError:
+        abort(400, f"{name} deve essere un intero")
+    return max(lo, min(value, hi))
+
 @app.route("/api/batteries/<ugrid_id>/<int:bat_idx>/history", methods=["GET"])
 def api_battery_history(ugrid_id, bat_idx):
+    if request.args.get("points") is not None:
+        points = _int_arg("points", HISTORY_POINTS_MAX, HISTORY_POINTS_MIN, HISTORY_POINTS_MAX)
+        return _battery_history_downsampled(ugrid_id, bat_idx, points)
+
     limit = int(request.args.get("limit", 100))
     with rca.db_lock:
         conn = get_mysql_connection(DB_NAME)
         try:
             cur = conn.cursor(dictionary=True)
-            cur.execute("SELECT * FROM telemetry WHERE ugrid_id=%s AND battery_index=%s ORDER BY ts DESC LIMIT %s", 
+            cur.execute(TELEMETRY_SELECT + " WHERE t.ugrid_id=%s AND t.battery_index=%s ORDER BY t.ts DESC LIMIT %s",
                         (ugrid_id, bat_idx, limit))
             rows = cur.fetchall()
         finally:
@@ -727,18 +1787,74 @@ def api_battery_history(ugrid_id, bat_idx):
     for r in rows: r["ts"] = r["ts"].isoformat()
     return jsonify(rows)
 
+def _battery_history_downsampled(ugrid_id, bat_idx, points):
+    # points=N: al piu' N righe scelte con LTTB sulla serie "y" (default soc)
+    # entro la finestra definita da limit e/o since, stesso ordine (ts DESC)
+    y_key = request.args.get("y", "soc")
+    if y_key not in HISTORY_SERIES: abort(400, "serie y invalida")
+    limit = _int_arg("limit", HISTORY_MAX_ROWS, 1, HISTORY_MAX_ROWS)
+
+    where = "t.ugrid_id=%s AND t.battery_index=%s"
+    args: list = [ugrid_id, bat_idx]
+    since = request.args.get("since")
+    if since:
+        try:
+            args.append(datetime.fromisoformat(since))
+        except ValueError:
+            abort(400, "since invalido")
+        where += " AND t.ts >= %s"
+
+    out = []
+    with rca.db_lock:
+        conn = get_mysql_connection(DB_NAME)
+        try:
+            cur = conn.cursor()
+            cur.execute(f"SELECT COUNT(*) FROM telemetry t WHERE {where}", tuple(args))
+            n_total = min(int(cur.fetchone()[0]), limit)
+            cur.close()
+
+            cur = conn.cursor(dictionary=True)
+            cur.execute(f"{TELEMETRY_SELECT} WHERE {where} ORDER BY t.ts DESC LIMIT %s",
+                        tuple(args) + (n_total,))
+            lttb = LttbDownsampler(n_total, points, y_key) if n_total > points else None
+            while True:
+                chunk = cur.fetchmany(HISTORY_FETCH_CHUNK)
+                if not chunk:
+                    break
+                for r in chunk:
+                    out.extend(lttb.push(r) if lttb else (r,))
+            if lttb:
+                out.extend(lttb.finish())
+            cur.close()
+        finally:
+            conn.close()
+    for r in out: r["ts"] = r["ts"].isoformat()
+    return jsonify(out)
+
+@app.route("/api/ugrids/<ugrid_id>/site_history", methods=["GET"])
+def api_site_history(ugrid_id):
+    # servita dal solo indice (ugrid_id, ts, load, pv, grid) di site_telemetry
+    if ugrid_id not in UGRIDS: abort(404, "uGrid sconosciuto")
+    limit = int(request.args.get("limit", 100))
+    with rca.db_lock:
+        conn = get_mysql_connection(DB_NAME)
+        try:
+            cur = conn.cursor(dictionary=True)
+            cur.execute("""
+                SELECT ts, load_kw, pv_kw, grid_power_kw FROM site_telemetry
+                WHERE ugrid_id=%s ORDER BY ts DESC LIMIT %s
+            """, (ugrid_id, limit))
+            rows = cur.fetchall()
+        finally:
+            conn.close()
+    for r in rows: r["ts"] = r["ts"].isoformat()
+    return jsonify(rows)
+
 @app.route("/api/ugrids/<ugrid_id>/mpc_params", methods=["POST", "GET"])
 def api_mpc_params(ugrid_id):
     if ugrid_id not in UGRIDS: abort(404, "uGrid sconosciuto")
     if request.method == "GET":
-        with rca.db_lock:
-            conn = get_mysql_connection(DB_NAME)
-            try:
-                cur = conn.cursor(dictionary=True)
-                cur.execute("SELECT * FROM mpc_params WHERE ugrid_id=%s", (ugrid_id,))
-                row = cur.fetchone()
-            finally:
-                conn.close()
+        row = rca.get_mpc_params(ugrid_id)
         if not row: abort(404)
         row["updated_at"] = row["updated_at"].isoformat()
         return jsonify(row)
@@ -753,6 +1869,59 @@ def api_mpc_params(ugrid_id):
     rca.set_mpc_params(ugrid_id, a, b, g, p)
     return jsonify({"status": "ok"})
 
+@app.route("/api/ugrids/<ugrid_id>/peak", methods=["POST"])
+def api_peak_shaving(ugrid_id):
+    if ugrid_id not in UGRIDS: abort(404, "uGrid sconosciuto")
+    data = request.get_json(force=True, silent=True) or {}
+    try:
+        enabled = bool(data["enabled"])
+        weight = float(data.get("weight", 0.5))
+    except: abort(400)
+    if weight < 0: abort(400)
+    rca.set_peak_shaving(ugrid_id, enabled, weight)
+    return jsonify({"status": "ok"})
+
+@app.route("/api/ugrids/<ugrid_id>/event", methods=["POST"])
+def api_grid_event(ugrid_id):
+    # {"delta_kw": float, "duration_s": int}: > 0 assorbe, < 0 immette,
+    # duration_s = 0 annulla l'evento
+    if ugrid_id not in UGRIDS: abort(404, "uGrid sconosciuto")
+    data = request.get_json(force=True, silent=True) or {}
+    try:
+        delta_kw = float(data.get("delta_kw", 0.0))
+        duration = int(data["duration_s"])
+    except: abort(400)
+    if duration < 0: abort(400)
+    send_ugrid_event(ugrid_id, delta_kw, duration)
+    return jsonify({"status": "ok"})
+
+@app.route("/api/ugrids/<ugrid_id>/export_cap", methods=["POST"])
+def api_export_cap(ugrid_id):
+    if ugrid_id not in UGRIDS: abort(404, "uGrid sconosciuto")
+    data = request.get_json(force=True, silent=True) or {}
+    if "cap_kw" not in data: abort(400)
+    cap_kw = data["cap_kw"]
+    if cap_kw is not None:
+        try: cap_kw = float(cap_kw)
+        except: abort(400)
+        if cap_kw < 0: abort(400)
+    rca.set_export_cap(ugrid_id, cap_kw)
+    return jsonify({"status": "ok"})
+
+@app.route("/api/metrics", methods=["GET"])
+def api_metrics():
+    out = {"coap_writes": coap_writer.metrics(), "nodes": rca.node_stats}
+    if rca.twin is not None:
+        out["twin"] = rca.twin.metrics()
+    out["mqtt_state"] = {"received": rca.mqtt_state.received, "dropped": rca.mqtt_state.dropped}
+    return jsonify(out)
+
+@app.route("/api/twin", methods=["GET"])
+def api_twin():
+    # stato predetto per batteria; source=twin dove mancano le misure
+    if rca.twin is None: abort(404, "Digital twin non attivo")
+    return jsonify(rca.twin.snapshot())
+
 @app.route("/api/alerts", methods=["GET"])
 def api_alerts():
     limit = int(request.args.get("limit", 50))
@@ -783,8 +1952,18 @@ def main():
     signal.signal(signal.SIGINT, handle_sig)
     signal.signal(signal.SIGTERM, handle_sig)
     
-    # Flask gestito nel main thread
-    app.run(host="0.0.0.0", port=3000, debug=False, threaded=True)
+    if uvicorn is None:
+        logger.warning("uvicorn/asgiref non disponibili, uso server Flask di sviluppo")
+        app.run(host=HTTP_HOST, port=HTTP_PORT, debug=False, threaded=True)
+        return
+
+    # Flask esposto come app ASGI: le richieste sono servite da un event loop
+    # e da un pool di thread limitato invece di un thread per richiesta.
+    # uvicorn installa i propri handler SIGINT/SIGTERM e ritorna allo shutdown
+    uvicorn.run(WsgiToAsgi(app), host=HTTP_HOST, port=HTTP_PORT,
+                log_level="warning", access_log=False)
+    logger.info("Arresto RCA...")
+    rca.stop()
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,249 @@
+#ifndef _BATTERY_PHYSICS_H
+#define _BATTERY_PHYSICS_H
+
+/*
+ * Battery pack model (Li-ion, pacco domestico 13.5 kWh scalato) advanced by
+ * one dt per physics step. Pure code: measurement noise is passed in as
+ * unit draws in [-1, 1), so the node and the host harnesses run the same
+ * kernel on the same inputs.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include "constants.h"
+
+#define SCALED_CAPACITY_AH 200.0f   /* Scaled capacity: 200Ah (100x cells in parallel) */
+
+/* 1 = integer implementation of derating + physics (battery_physics_fixed.h) */
+#ifndef BATTERY_PHYS_CONF_FIXED
+#define BATTERY_PHYS_CONF_FIXED 0
+#endif
+
+typedef struct {
+    float voltage;
+    float current;
+    float temp;
+    float soc;
+    float soh;
+    float capacity_ah;
+    uint32_t charge_cycles;       /* Numero di cicli carica/scarica */
+    float total_ah_throughput;    /* Ah totali trasferiti */
+    float peak_temp;              /* Temperatura massima raggiunta */
+    bool  was_charging;           /* Per contare cicli */
+} battery_phys_t;
+
+#define BATTERY_PHYS_INIT { 3.7f, 0.0f, 25.0f, 0.8f, 1.0f, SCALED_CAPACITY_AH, 0, 0.0f, 25.0f, false }
+
+// noise draws consumed by one step, in this order
+enum { PHYS_NOISE_CURRENT, PHYS_NOISE_VOLTAGE, PHYS_NOISE_TEMP, PHYS_NOISE_COUNT };
+
+/*
+ * 0. LEGA LA POTENZA EROGABILE ALLO STATE OF CHARGE
+ */
+#define SOC_EMPTY_CUTOFF      0.02f  /* sotto 2% vietata scarica */
+#define SOC_DERATE_DISCHARGE  0.10f  /* sotto 10% scarica deratata */
+#define SOC_FULL_CUTOFF       0.98f  /* sopra 98% vietata carica */
+#define SOC_DERATE_CHARGE     0.90f  /* sopra 90% carica deratata */
+
+#if BATTERY_PHYS_CONF_FIXED
+#include "battery_physics_fixed.h"
+#else
+
+static inline float battery_derate_power(float soc, float power) {
+    /* Comando di SCARICA (potenza negativa) */
+    if (power < -0.5f) {
+        if (soc <= SOC_EMPTY_CUTOFF) {
+            power = 0.0f;
+        } else if (soc < SOC_DERATE_DISCHARGE) {
+            float scale = (soc - SOC_EMPTY_CUTOFF) /
+                          (SOC_DERATE_DISCHARGE - SOC_EMPTY_CUTOFF);
+            if (scale < 0.0f) scale = 0.0f;
+            power *= scale;
+        }
+    }
+
+    /* Comando di CARICA (potenza positiva) */
+    if(power > 0.5f) {
+        if(soc >= SOC_FULL_CUTOFF) {
+            power = 0.0f;
+        } else if(soc > SOC_DERATE_CHARGE) {
+            float scale = (SOC_FULL_CUTOFF - soc) /
+                          (SOC_FULL_CUTOFF - SOC_DERATE_CHARGE);
+            if(scale < 0.0f) scale = 0.0f;
+            power *= scale;
+        }
+    }
+    return power;
+}
+
+// power: already derated setpoint [W]
+static inline void battery_physics_step(battery_phys_t *b, float power,
+                                        const float noise[PHYS_NOISE_COUNT]) {
+    /* Parametri fisici della batteria Li-ion SCALATA (Pacco Domestico 13.5kWh) */
+    const float BATTERY_CAPACITY_AH = SCALED_CAPACITY_AH;  /* Capacità scalata: 200Ah */
+    const float NOMINAL_VOLTAGE = 3.7f;                     /* Tensione nominale [V] - manteniamo bassa per ML */
+    const float V_MIN = 3.0f;                               /* Tensione minima scarica [V] */
+    const float V_MAX = 4.2f;                               /* Tensione massima carica [V] */
+    const float INTERNAL_RESISTANCE = 0.0008f;              /* Resistenza interna [Ω] - scalata (0.08/100) */
+    const float THERMAL_MASS = 5000.0f;                     /* Massa termica scalata [J/°C] - pacco grande */
+    const float HEAT_DISSIPATION = 200.0f;                  /* Coefficiente dissipazione [W/°C] - scalato */
+    const float AMBIENT_TEMP = 25.0f;                       /* Temperatura ambiente [°C] */
+    const float EFFICIENCY = 0.92f;                         /* Efficienza conversione - più realistica */
+    const float MAX_C_RATE = 15.0f;                         /* Limite di corrente [C] */
+    const float TEMP_MAX = 80.0f;                           /* Limite superiore del modello termico [°C] */
+
+    /* Timestep di aggiornamento (1 secondo) */
+    const float dt = 1.0f; /* [s] */
+
+    /* 1. CALCOLA CORRENTE dalla potenza richiesta */
+    float ocv = V_MIN + (V_MAX - V_MIN) * b->soc;
+    float requested_current = (ocv > 0.1f) ? (power / ocv) : 0.0f;
+    float current_noise = noise[PHYS_NOISE_CURRENT] * (0.02f * fabs(requested_current));
+    b->current = requested_current + current_noise;
+
+    /* Limita corrente in base a C-rate */
+    float max_current = BATTERY_CAPACITY_AH * MAX_C_RATE;
+    if(b->current > max_current) b->current = max_current;
+    if(b->current < -max_current) b->current = -max_current;
+
+    /* 2. AGGIORNA TENSIONE */
+    b->voltage = ocv - (b->current * INTERNAL_RESISTANCE);
+
+    if(b->soc < 0.1f) {
+        b->voltage -= (0.1f - b->soc) * 2.0f;
+    }
+    if(b->soc > 0.9f) {
+        b->voltage += (b->soc - 0.9f) * 0.5f;
+    }
+
+    if(b->voltage > V_MAX) b->voltage = V_MAX;
+    if(b->voltage < V_MIN) b->voltage = V_MIN;
+    b->voltage += noise[PHYS_NOISE_VOLTAGE] * 0.01f;
+
+    /* 3. AGGIORNA STATE OF CHARGE */
+    float efficiency = (b->current > 0) ? EFFICIENCY : (1.0f / EFFICIENCY);
+    float energy_joules = power * efficiency * dt;
+    float current_capacity_ah = BATTERY_CAPACITY_AH * b->soh;
+    float capacity_joules = current_capacity_ah * NOMINAL_VOLTAGE * 3600.0f;
+    float delta_soc = energy_joules / capacity_joules;
+    b->soc += delta_soc;
+
+    float ah_transferred = fabs(b->current) * (dt / 3600.0f);
+    b->total_ah_throughput += ah_transferred;
+
+    bool is_charging = (b->current > 0.5f);
+    if(is_charging && !b->was_charging && b->soc < 0.5f) {
+        b->charge_cycles++;
+    }
+    b->was_charging = is_charging;
+
+    if(b->soc > 1.0f) b->soc = 1.0f;
+    if(b->soc < 0.0f) b->soc = 0.0f;
+
+    /* 4. AGGIORNA TEMPERATURA */
+    float power_loss = b->current * b->current * INTERNAL_RESISTANCE;
+    float heat_generated = power_loss * dt;
+    float heat_dissipated = HEAT_DISSIPATION * (b->temp - AMBIENT_TEMP) * dt;
+    float delta_temp = (heat_generated - heat_dissipated) / THERMAL_MASS;
+    b->temp += delta_temp;
+    b->temp += noise[PHYS_NOISE_TEMP] * 0.5f;
+
+    if(b->temp > b->peak_temp) {
+        b->peak_temp = b->temp;
+    }
+
+    if(b->temp < 0.0f) b->temp = 0.0f;
+    if(b->temp > TEMP_MAX) b->temp = TEMP_MAX;
+
+    /* 5. AGGIORNA CAPACITÀ (SoH) */
+    float cycle_degradation = b->charge_cycles * 0.0008f;
+    float throughput_degradation = b->total_ah_throughput * 0.00005f;
+
+    float temp_degradation = 0.0f;
+    if(b->temp > 40.0f) {
+        temp_degradation = (b->temp - 40.0f) * 0.0001f;
+    }
+    if(b->temp > 55.0f) {
+        temp_degradation += (b->temp - 55.0f) * 0.0005f;
+    }
+
+    float soc_stress_degradation = 0.0f;
+    if(b->soc < 0.15f) {
+        soc_stress_degradation = (0.15f - b->soc) * 0.0002f;
+    }
+    if(b->soc > 0.95f) {
+        soc_stress_degradation = (b->soc - 0.95f) * 0.0001f;
+    }
+
+    float c_rate = fabs(b->current) / BATTERY_CAPACITY_AH;
+    float c_rate_degradation = 0.0f;
+    if(c_rate > 3.0f) {
+        c_rate_degradation = (c_rate - 3.0f) * 0.00003f;
+    }
+
+    float total_degradation = cycle_degradation + throughput_degradation +
+                             temp_degradation + soc_stress_degradation +
+                             c_rate_degradation;
+
+    b->soh -= total_degradation * dt;
+
+    if(b->soh > 1.0f) b->soh = 1.0f;
+    if(b->soh < 0.5f) b->soh = 0.5f;
+
+    b->capacity_ah = BATTERY_CAPACITY_AH * b->soh;
+}
+#endif /* BATTERY_PHYS_CONF_FIXED */
+
+/*
+ * Range where the ML SoH estimate is trusted: the model was trained on
+ * cycles above 1.4 Ah of 2.0 Ah nominal (SoH >= 70%), and it is only a
+ * cross-check of the model SoH. Outside either bound it extrapolates (the
+ * node features are not scaled like the training set), and since the blend
+ * converges to the ML value it would drag every battery to the SoH floor.
+ */
+#define SOH_ML_MIN_PCT   70.0f
+#define SOH_ML_MAX_PCT   100.0f
+#define SOH_ML_MAX_DEV   0.10f   // max |ML - model| SoH to take the estimate
+
+// safety check: ML SoH estimate [%] blended with the model SoH
+static inline float battery_soh_blend(float soh, float temp, float soc, float ml_pct) {
+    // implausible estimate: the model SoH stands in for it (clamping it into
+    // the range instead would lift batteries near the floor to 70%)
+    float ml_soh = ml_pct / 100.0f;  // 0..1
+    if (ml_pct < SOH_ML_MIN_PCT || ml_pct > SOH_ML_MAX_PCT || fabsf(ml_soh - soh) > SOH_ML_MAX_DEV) {
+        ml_soh = soh;
+    }
+    float combined_soh = (ml_soh*0.7f) + (soh*0.3f);
+
+    // thermal effect
+    if(temp > 45.0f) {
+        combined_soh -= (temp - 45.0f) * 0.001f;
+    }
+
+    // low state of charge effect
+    if(soc < 0.1f) {
+        combined_soh -= (0.1f - soc) * 0.02f;
+    }
+
+    // to high or too low combined soh
+    if(combined_soh > 1.0f) combined_soh = 1.0f;
+    if(combined_soh < 0.5f) combined_soh = 0.5f;
+
+    // final battery soh
+    return (soh * 0.95f) + (combined_soh * 0.05f);
+}
+
+// shift the SoH window by one sample (ML_WINDOW x N_FEATURES, still float)
+static inline void battery_push_features(const battery_phys_t *b, float *buf) {
+    for(int i=0; i<(ML_WINDOW-1)*N_FEATURES; i++) {
+        buf[i] = buf[i+N_FEATURES];
+    }
+    int idx = (ML_WINDOW-1)*N_FEATURES;
+    buf[idx] = b->voltage / 4.2f;
+    buf[idx+1] = ((b->current + 10.0f) / 20.0f);
+    buf[idx+2] = b->temp / 80.0f;
+    buf[idx+3] = b->soc;
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef _BATTERY_PHYSICS_FIXED_H
+#define _BATTERY_PHYSICS_FIXED_H
+
+/*
+ * Fixed-point body of battery_derate_power() / battery_physics_step() for
+ * nodes without FPU (BATTERY_PHYS_CONF_FIXED=1). The battery_phys_t
+ * interface stays float, as the rest of the node (ML features, CoAP
+ * payloads) uses it: state is converted once on entry and once on exit,
+ * all the arithmetic in between is integer on precomputed Q constants.
+ *
+ *   SoC                 Q24 (1.0 = 2^24)
+ *   SoH                 Q30
+ *   voltage, temp, W    Q16
+ *   current, power      Q8
+ *   Ah throughput       Q16 (64 bit)
+ *   noise               Q15
+ *   degradation         Q40 per step
+ *
+ * Validated against the float model with the golden harness:
+ *   cd tools/golden && make check ALT_CFLAGS=-DBATTERY_PHYS_CONF_FIXED=1
+ */
+
+#include <stdint.h>
+
+// compile-time conversion of a constant to Q format (rounded)
+#define PQ(x, q) ((int64_t)((x) * (double)(1LL << (q)) + ((x) >= 0 ? 0.5 : -0.5)))
+
+static inline int32_t pq_from_f(float x, int q) {
+    float s = x * (float)(1L << q);
+    return (int32_t)(s >= 0.0f ? s + 0.5f : s - 0.5f);
+}
+
+static inline float pq_to_f(int64_t x, int q) {
+    return (float)x / (float)(1L << q);
+}
+
+// rounded arithmetic shift / division
+static inline int64_t pq_shr(int64_t x, int s) {
+    return (x + ((int64_t)1 << (s - 1))) >> s;
+}
+
+static inline int64_t pq_div(int64_t n, int64_t d) {
+    return ((n < 0) == (d < 0)) ? (n + d / 2) / d : (n - d / 2) / d;
+}
+
+/* OCV(SoC) a 16 segmenti [Q16]: 3.0 V + 1.2 V * SoC come il modello float;
+ * una curva misurata si sostituisce qui senza toccare il resto */
+#define OCV_SEGMENTS_LOG2 4
+static const int32_t ocv_lut_q16[(1 << OCV_SEGMENTS_LOG2) + 1] = {
+    PQ(3.000, 16), PQ(3.075, 16), PQ(3.150, 16), PQ(3.225, 16),
+    PQ(3.300, 16), PQ(3.375, 16), PQ(3.450, 16), PQ(3.525, 16),
+    PQ(3.600, 16), PQ(3.675, 16), PQ(3.750, 16), PQ(3.825, 16),
+    PQ(3.900, 16), PQ(3.975, 16), PQ(4.050, 16), PQ(4.125, 16),
+    PQ(4.200, 16),
+};
+
+static inline int32_t battery_ocv_q16(int32_t soc_q24) {
+    const int shift = 24 - OCV_SEGMENTS_LOG2;
+    if (soc_q24 <= 0) return ocv_lut_q16[0];
+    if (soc_q24 >= (1 << 24)) return ocv_lut_q16[1 << OCV_SEGMENTS_LOG2];
+    int idx = soc_q24 >> shift;
+    int32_t frac = soc_q24 & ((1 << shift) - 1);
+    int32_t lo = ocv_lut_q16[idx];
+    return lo + (int32_t)pq_shr((int64_t)(ocv_lut_q16[idx + 1] - lo) * frac, shift);
+}
+
+/* Coefficienti di degrado SoH per passo [Q40], stesso ordine del modello float */
+enum { DEG_CYCLE, DEG_AH, DEG_T40, DEG_T55, DEG_SOC_LOW, DEG_SOC_HIGH, DEG_CRATE, DEG_COUNT };
+static const int64_t deg_q40[DEG_COUNT] = {
+    PQ(0.0008, 40),           // per ciclo
+    PQ(0.00005, 40),          // per Ah
+    PQ(0.0001, 40),           // per °C oltre 40
+    PQ(0.0005, 40),           // per °C oltre 55
+    PQ(0.0002, 40),           // per unita' di SoC sotto 0.15
+    PQ(0.0001, 40),           // per unita' di SoC sopra 0.95
+    PQ(0.00003 / 200.0, 40),  // per A oltre 3C (600 A)
+};
+
+/* SoC per joule, efficienza inclusa [Q48]: 1 / (200 Ah * 3.7 V * 3600 s) */
+#define PHYS_J_TO_SOC       (1.0 / (SCALED_CAPACITY_AH * 3.7 * 3600.0))
+static const int64_t effk_chg_q48 = PQ(0.92 * PHYS_J_TO_SOC, 48);
+static const int64_t effk_dis_q48 = PQ(PHYS_J_TO_SOC / 0.92, 48);
+
+static inline float battery_derate_power(float soc, float power) {
+    int32_t s = pq_from_f(soc, 24);
+    int32_t p = pq_from_f(power, 8);
+    int32_t d = p;
+
+    /* Comando di SCARICA (potenza negativa) */
+    if (p < -PQ(0.5, 8)) {
+        if (s <= PQ(SOC_EMPTY_CUTOFF, 24)) {
+            d = 0;
+        } else if (s < PQ(SOC_DERATE_DISCHARGE, 24)) {
+            d = (int32_t)pq_div((int64_t)p * (s - PQ(SOC_EMPTY_CUTOFF, 24)),
+                                PQ(SOC_DERATE_DISCHARGE - SOC_EMPTY_CUTOFF, 24));
+        }
+    }
+
+    /* Comando di CARICA (potenza positiva) */
+    if (d > PQ(0.5, 8)) {
+        if (s >= PQ(SOC_FULL_CUTOFF, 24)) {
+            d = 0;
+        } else if (s > PQ(SOC_DERATE_CHARGE, 24)) {
+            d = (int32_t)pq_div((int64_t)d * (PQ(SOC_FULL_CUTOFF, 24) - s),
+                                PQ(SOC_FULL_CUTOFF - SOC_DERATE_CHARGE, 24));
+        }
+    }
+    // untouched setpoints go back bit-exact
+    return d == p ? power : pq_to_f(d, 8);
+}
+
+static inline void battery_physics_step(battery_phys_t *b, float power,
+                                        const float noise[PHYS_NOISE_COUNT]) {
+    const int32_t V_MIN = PQ(3.0, 16);
+    const int32_t V_MAX = PQ(4.2, 16);
+    const int64_t R_Q24 = PQ(0.0008, 24);           /* Resistenza interna [Ω] */
+    const int32_t I_MAX = PQ(SCALED_CAPACITY_AH * 15.0, 8);
+    const int32_t T_AMB = PQ(25.0, 16);
+
+    int32_t p    = pq_from_f(power, 8);
+    int32_t soc  = pq_from_f(b->soc, 24);
+    int32_t soh  = pq_from_f(b->soh, 30);
+    int32_t temp = pq_from_f(b->temp, 16);
+    int32_t peak = pq_from_f(b->peak_temp, 16);
+    int64_t ah   = (int64_t)(b->total_ah_throughput * 65536.0f + 0.5f);
+    int32_t n_i  = pq_from_f(noise[PHYS_NOISE_CURRENT], 15);
+    int32_t n_v  = pq_from_f(noise[PHYS_NOISE_VOLTAGE], 15);
+    int32_t n_t  = pq_from_f(noise[PHYS_NOISE_TEMP], 15);
+
+    /* 1. CORRENTE dalla potenza richiesta [Q8] */
+    int32_t ocv = battery_ocv_q16(soc);
+    int32_t i_req = (int32_t)pq_div((int64_t)p << 16, ocv);
+    int32_t i_abs = i_req < 0 ? -i_req : i_req;
+    int32_t i = i_req + (int32_t)pq_shr((int64_t)i_abs * n_i * PQ(0.02, 16), 31);
+    if (i > I_MAX) i = I_MAX;
+    if (i < -I_MAX) i = -I_MAX;
+
+    /* 2. TENSIONE [Q16] */
+    int32_t v = ocv - (int32_t)pq_shr((int64_t)i * R_Q24, 16);
+    if (soc < PQ(0.1, 24)) {
+        v -= (int32_t)pq_shr((int64_t)(PQ(0.1, 24) - soc) * 2, 8);
+    }
+    if (soc > PQ(0.9, 24)) {
+        v += (int32_t)pq_shr(soc - PQ(0.9, 24), 9);
+    }
+    if (v > V_MAX) v = V_MAX;
+    if (v < V_MIN) v = V_MIN;
+    v += (int32_t)pq_shr((int64_t)n_v * PQ(0.01, 16), 15);
+
+    /* 3. STATE OF CHARGE [Q24]: P * eff * k / SoH */
+    int64_t effk = i > 0 ? effk_chg_q48 : effk_dis_q48;
+    soc += (int32_t)pq_shr(pq_div((int64_t)p * effk, soh), 2);
+
+    i_abs = i < 0 ? -i : i;
+    ah += pq_div((int64_t)i_abs * 256, 3600);       /* dt / 3600 s, Q8 -> Q16 */
+
+    bool is_charging = i > PQ(0.5, 8);
+    if (is_charging && !b->was_charging && soc < PQ(0.5, 24)) {
+        b->charge_cycles++;
+    }
+    b->was_charging = is_charging;
+
+    if (soc > (1 << 24)) soc = 1 << 24;
+    if (soc < 0) soc = 0;
+
+    /* 4. TEMPERATURA [Q16]: (I^2 R - h (T - Tamb)) / C */
+    int64_t heat = pq_shr((int64_t)i * i * R_Q24, 24);
+    int64_t dissipated = 200LL * (temp - T_AMB);
+    temp += (int32_t)pq_div(heat - dissipated, 5000);
+    temp += n_t;                                    /* 0.5 * noise [Q16] = noise [Q15] */
+
+    if (temp > peak) peak = temp;
+    if (temp < 0) temp = 0;
+    if (temp > PQ(80.0, 16)) temp = PQ(80.0, 16);
+
+    /* 5. CAPACITA' (SoH) [Q40 -> Q30] */
+    int64_t deg = (int64_t)b->charge_cycles * deg_q40[DEG_CYCLE];
+    deg += pq_shr((ah >> 8) * deg_q40[DEG_AH], 8);
+    if (temp > PQ(40.0, 16)) deg += pq_shr((int64_t)(temp - PQ(40.0, 16)) * deg_q40[DEG_T40], 16);
+    if (temp > PQ(55.0, 16)) deg += pq_shr((int64_t)(temp - PQ(55.0, 16)) * deg_q40[DEG_T55], 16);
+    if (soc < PQ(0.15, 24)) {
+        deg += pq_shr((int64_t)(PQ(0.15, 24) - soc) * deg_q40[DEG_SOC_LOW], 24);
+    } else if (soc > PQ(0.95, 24)) {
+        deg += pq_shr((int64_t)(soc - PQ(0.95, 24)) * deg_q40[DEG_SOC_HIGH], 24);
+    }
+    if (i_abs > PQ(600.0, 8)) deg += pq_shr((int64_t)(i_abs - PQ(600.0, 8)) * deg_q40[DEG_CRATE], 8);
+
+    soh -= (int32_t)pq_shr(deg, 10);
+    if (soh > (1 << 30)) soh = 1 << 30;
+    if (soh < PQ(0.5, 30)) soh = PQ(0.5, 30);
+
+    b->current = pq_to_f(i, 8);
+    b->voltage = pq_to_f(v, 16);
+    b->soc = pq_to_f(soc, 24);
+    b->soh = pq_to_f(soh, 30);
+    b->temp = pq_to_f(temp, 16);
+    b->peak_temp = pq_to_f(peak, 16);
+    b->total_ah_throughput = pq_to_f(ah, 16);
+    b->capacity_ah = SCALED_CAPACITY_AH * b->soh;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef _COAP_STATS_H
+#define _COAP_STATS_H
+
+#include <stdint.h>
+#include "coap-engine.h"
+#include "cbor.h"
+
+// resources tracked by the statistics module (ctrl/* grouped together)
+typedef enum {
+    STATS_RES_STATE,
+    STATS_RES_POWER,
+    STATS_RES_REGISTER,
+    STATS_RES_CTRL,
+    STATS_RES_STATS,
+    STATS_RES_DIAG,
+    STATS_RES_COUNT
+} stats_res_t;
+
+typedef struct {
+    uint32_t requests;
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+} res_stats_t;
+
+/*
+ * Application-level CoAP counters. The Contiki CoAP engine exposes no hooks
+ * for its transaction layer, so retransmissions are not counted: /dev/stats
+ * reports timeouts x COAP_MAX_RETRANSMIT (the retries burned by requests that
+ * never got an answer), which misses requests that succeeded after a retry.
+ * Duplicates are observe notifications whose sequence number did not advance.
+ * Notifications run the GET handler but are not requests: they are counted
+ * in notify_sent only (see coap_stats_notify()).
+ */
+typedef struct {
+    uint32_t req_sent;
+    uint32_t resp_ok;
+    uint32_t resp_err;
+    uint32_t timeouts;
+
+    uint32_t notify_sent;
+    uint32_t notify_rcvd;
+    uint32_t notify_dup;
+    uint32_t obs_reg_ok;
+    uint32_t obs_reg_fail;
+    uint32_t obs_stale;       // relations declared stale (no notifications)
+    uint32_t obs_rereg;       // re-registrations attempted
+    uint8_t  notifying;       // inside coap_notify_observers()
+
+    res_stats_t res[STATS_RES_COUNT];
+} coap_stats_t;
+
+extern coap_stats_t coap_stats;
+
+#ifndef COAP_MAX_RETRANSMIT
+#define COAP_MAX_RETRANSMIT 4
+#endif
+
+static inline void coap_stats_rx(stats_res_t r, int len) {
+    if(coap_stats.notifying) return;
+    coap_stats.res[r].requests++;
+    if(len > 0) coap_stats.res[r].bytes_in += (uint32_t)len;
+}
+
+static inline void coap_stats_tx(stats_res_t r, int len) {
+    if(len > 0) coap_stats.res[r].bytes_out += (uint32_t)len;
+}
+
+// observe notification: the GET handler it runs does not count as a request
+static inline void coap_stats_notify(coap_resource_t *r) {
+    coap_stats.notify_sent++;
+    coap_stats.notifying = 1;
+    coap_notify_observers(r);
+    coap_stats.notifying = 0;
+}
+
+// outcome of a request sent with COAP_BLOCKING_REQUEST (NULL = timeout)
+static inline void coap_stats_response(const coap_message_t *response) {
+    if(response == NULL) {
+        coap_stats.timeouts++;
+    } else if(response->code >= 64 && response->code < 96) {  // 2.xx
+        coap_stats.resp_ok++;
+    } else {
+        coap_stats.resp_err++;
+    }
+}
+
+/*
+ * Common part of the /dev/stats CBOR map (keys 0..3), nodes append their
+ * own keys before closing the map:
+ * { 0: uptime [s],
+ *   1: [req_sent, resp_ok, resp_err, timeouts, timeouts_x_retx],
+ *   2: [notify_sent, notify_rcvd, notify_dup, obs_reg_ok, obs_reg_fail,
+ *       obs_stale, obs_rereg],
+ *   3: [[requests, bytes_in, bytes_out] per stats_res_t] }
+ */
+static inline void coap_stats_write_cbor(cbor_writer_state_t *ws) {
+    cbor_write_unsigned(ws, 0);
+    cbor_write_unsigned(ws, (uint64_t)clock_seconds());
+
+    cbor_write_unsigned(ws, 1);
+    cbor_open_array(ws);
+    cbor_write_unsigned(ws, coap_stats.req_sent);
+    cbor_write_unsigned(ws, coap_stats.resp_ok);
+    cbor_write_unsigned(ws, coap_stats.resp_err);
+    cbor_write_unsigned(ws, coap_stats.timeouts);
+    cbor_write_unsigned(ws, (uint64_t)coap_stats.timeouts * COAP_MAX_RETRANSMIT);
+    cbor_close_array(ws);
+
+    cbor_write_unsigned(ws, 2);
+    cbor_open_array(ws);
+    cbor_write_unsigned(ws, coap_stats.notify_sent);
+    cbor_write_unsigned(ws, coap_stats.notify_rcvd);
+    cbor_write_unsigned(ws, coap_stats.notify_dup);
+    cbor_write_unsigned(ws, coap_stats.obs_reg_ok);
+    cbor_write_unsigned(ws, coap_stats.obs_reg_fail);
+    cbor_write_unsigned(ws, coap_stats.obs_stale);
+    cbor_write_unsigned(ws, coap_stats.obs_rereg);
+    cbor_close_array(ws);
+
+    cbor_write_unsigned(ws, 3);
+    cbor_open_array(ws);
+    for(int r = 0; r < STATS_RES_COUNT; r++) {
+        cbor_open_array(ws);
+        cbor_write_unsigned(ws, coap_stats.res[r].requests);
+        cbor_write_unsigned(ws, coap_stats.res[r].bytes_in);
+        cbor_write_unsigned(ws, coap_stats.res[r].bytes_out);
+        cbor_close_array(ws);
+    }
+    cbor_close_array(ws);
+}
+
+#endif
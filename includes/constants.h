@@ -8,6 +8,7 @@
 #define BATTERY_TIMEOUT_SEC 30
 #define BAT_MAX_POWER_KW  10.0f         // 10 kW nominali
 #define BAT_MAX_POWER_W   (BAT_MAX_POWER_KW * 1000.0f)
+#define BAT_CAPACITY_KWH  13.5f         // pacco domestico
 #define MAX_IRR   1200.0f
 
 // ML configuration
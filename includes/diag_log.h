@@ -0,0 +1,51 @@
+#ifndef _DIAG_LOG_H
+#define _DIAG_LOG_H
+
+#include <stdint.h>
+
+/*
+ * Diagnostic sample logger (battery node). One packed record per physics
+ * step is written to a fixed-size CFS ring; the ring is only read when
+ * someone downloads a time range from dev/diag, so full-resolution history
+ * costs flash, not radio. Each coalesced wakeup (SCHED_PERIOD, 5 s) runs
+ * one 1 s physics step per second of the period, so records are 1 s apart
+ * (1 Hz) and are written in bursts of 5. The default ring covers 30 minutes
+ * in about 30 KB of flash, reserved at boot.
+ */
+
+#ifndef DIAG_LOG_FILE
+#define DIAG_LOG_FILE "diag"
+#endif
+
+#ifndef DIAG_LOG_RECORDS
+#define DIAG_LOG_RECORDS 1800     // ring capacity (records): 30 min at 1 Hz
+#endif
+
+// fixed-point record, little-endian as written by the node (17 bytes)
+typedef struct __attribute__((packed)) {
+    uint32_t t;            // clock_seconds() at sampling time
+    uint16_t v_mv;         // voltage [mV]
+    int16_t  i_da;         // current [0.1 A]
+    int16_t  t_dc;         // temperature [0.1 °C]
+    uint16_t soc;          // SoC [0.01 %]
+    uint16_t soh;          // SoH [0.01 %]
+    int16_t  sp_dw;        // power setpoint [10 W]
+    uint8_t  state;        // battery_state_t
+} diag_record_t;
+
+#define DIAG_RECORD_SIZE ((int)sizeof(diag_record_t))
+
+void diag_log_init(void);
+void diag_log_append(const diag_record_t *rec);
+
+// number of records currently held in the ring
+uint16_t diag_log_count(void);
+// sequence number of the oldest record held (records appended since boot
+// are numbered 0, 1, ...; stable across wraps, unlike ring indexes)
+uint32_t diag_log_first_seq(void);
+// i-th record from the oldest one (0 = oldest), returns 0 on success
+int diag_log_read(uint16_t i, diag_record_t *rec);
+// record with sequence number seq, -1 if already overwritten or not written
+int diag_log_read_seq(uint32_t seq, diag_record_t *rec);
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef _ENV_MODEL_H
+#define _ENV_MODEL_H
+
+/*
+ * Site environment model (PV irradiance, household load) advanced once per
+ * control cycle. Pure code: randomness comes from the caller (random_rand
+ * on the node, a seeded generator in the host tools), so the same model
+ * drives the firmware and the off-line harnesses.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include "constants.h"
+
+#define ML_PRED_WINDOW 10
+#define N_PRED_FEAT 6
+
+typedef unsigned short (*env_rand_t)(void);
+
+typedef struct {
+    float hour;
+    float day;            // day of week normalized
+    float temp;
+    float cloud_cover;
+    bool  sunny_day;
+    bool  high_demand;
+    float base_load;
+    float irradiance;     // clear-sky irradiance used as ML feature
+    float pv;             // kW
+    float load;           // kW
+} env_state_t;
+
+#define ENV_STATE_INIT { 6.0f, 0.5f, 22.0f, 0.3f, true, false, 2.0f, 0.0f, 0.0f, 2.0f }
+
+// scenario knobs; ENV_PARAMS_DEFAULT reproduces the original node model
+typedef struct {
+    int   cloudy_pct;        // chance [%] that a new day is overcast
+    float cloud_volatility;  // cloud cover random walk step
+    int   event_pct;         // chance [%] of a load event per cycle
+    float event_scale;       // load event magnitude multiplier
+    float load_scale;        // household base load multiplier
+} env_params_t;
+
+#define ENV_PARAMS_DEFAULT { 31, 0.15f, 15, 1.0f, 1.0f }
+
+static inline void env_step_p(env_state_t *e, const env_params_t *p, env_rand_t rnd) {
+    e->hour += 0.5f;
+    if(e->hour >= 24.0f) {
+        e->hour = 0.0f;
+        e->sunny_day = (int)(rnd() % 100) >= p->cloudy_pct;
+        e->day += 0.1f;
+        if (e->day > 1.0f) {
+            e->day = 0.0f;
+        }
+    }
+
+    // prediction
+    e->irradiance = 0.0f;
+
+    // model to simulate irradiance and pv
+    if (e->hour >= 6.0f && e->hour < 18.0f) {
+        float sun_elevation = sin(3.14159f * (e->hour - 6.0f) / 12.0f);
+        e->irradiance = 1000.0f * sun_elevation;
+
+        e->cloud_cover += ((rnd() % 100) / 50.0f - 1.0f) * p->cloud_volatility;
+        if(e->cloud_cover < 0.0f) e->cloud_cover = 0.0f;
+        if(e->cloud_cover > 0.95f) e->cloud_cover = 0.95f;
+
+        if(!e->sunny_day) {
+            e->cloud_cover = 0.5f + (e->cloud_cover * 0.5f);
+        }
+
+        float cloud_factor = 1.0f - (e->cloud_cover * 0.85f);
+        float turbulence = 1.0f;
+        if(e->cloud_cover > 0.3f) {
+            turbulence = 0.7f + ((rnd() % 100) / 100.0f * 0.6f);
+        }
+
+        float effective_irradiance = e->irradiance * cloud_factor * turbulence;
+        float pv_peak = BAT_MAX_POWER_KW;
+
+        e->pv = (pv_peak * effective_irradiance / 1000.0f);
+        e->pv += ((rnd() % 100) / 100.0f - 0.5f) * 0.3f;
+
+        if(e->pv < 0.0f) e->pv = 0.0f;
+        if(e->pv > pv_peak) e->pv = pv_peak;
+    } else {
+        e->pv = 0.0f;
+        e->cloud_cover = 0.3f;
+    }
+
+    float hour_factor = 1.0f;
+
+    // model to simulate load
+    if(e->hour >= 0.0f && e->hour < 6.0f) {
+        hour_factor = 0.3f + ((rnd() % 20) / 100.0f);
+        e->high_demand = false;
+    }
+    else if(e->hour >= 6.0f && e->hour < 9.0f) {
+        float morning_ramp = (e->hour - 6.0f) / 3.0f;
+        hour_factor = 0.5f + (morning_ramp * 0.7f);
+        e->high_demand = (e->hour >= 7.0f && e->hour <= 8.5f);
+    }
+    else if(e->hour >= 9.0f && e->hour < 12.0f) {
+        hour_factor = 0.9f + ((rnd() % 30) / 100.0f);
+        e->high_demand = false;
+    }
+    else if(e->hour >= 12.0f && e->hour < 14.0f) {
+        hour_factor = 1.1f + ((rnd() % 20) / 100.0f);
+        e->high_demand = true;
+    }
+    else if(e->hour >= 14.0f && e->hour < 17.0f) {
+        hour_factor = 0.7f + ((rnd() % 30) / 100.0f);
+        e->high_demand = false;
+    }
+    else if(e->hour >= 17.0f && e->hour < 21.0f) {
+        hour_factor = 1.3f + ((rnd() % 40) / 100.0f);
+        e->high_demand = true;
+    }
+    else {
+        float evening_ramp = 1.0f - ((e->hour - 21.0f) / 3.0f);
+        hour_factor = 0.4f + (evening_ramp * 0.6f);
+        e->high_demand = false;
+    }
+
+    float event_load = 0.0f;
+    if((int)(rnd() % 100) < p->event_pct) {
+        event_load = (((rnd() % 30) / 10.0f) + 1.0f) * p->event_scale;
+    }
+
+    e->base_load = 2.5f * p->load_scale;
+    e->load = (e->base_load * hour_factor) + event_load;
+    e->load += ((rnd() % 100) / 100.0f - 0.5f) * 0.4f;
+
+    if(e->load < 0.5f) e->load = 0.5f;
+    if(e->load > BAT_MAX_POWER_KW * 0.8f) e->load = BAT_MAX_POWER_KW * 0.8f;
+}
+
+static inline void env_step(env_state_t *e, env_rand_t rnd) {
+    static const env_params_t defaults = ENV_PARAMS_DEFAULT;
+    env_step_p(e, &defaults, rnd);
+}
+
+// shift the predictor window by one step and append the current sample
+static inline void env_push_features(const env_state_t *e, float *features) {
+    for (int i=0; i<(ML_PRED_WINDOW-1)*N_PRED_FEAT; i++) {
+        features[i] = features[i+N_PRED_FEAT];
+    }
+
+    int idx = (ML_PRED_WINDOW-1)*N_PRED_FEAT;
+    features[idx] = (e->irradiance / MAX_IRR);
+    features[idx+1] = e->temp; // resolution of 0.25oC
+    features[idx+2] = e->hour/24.0f; // hour normalized
+    features[idx+3] = e->day;
+    features[idx+4] = e->pv/BAT_MAX_POWER_KW;
+    features[idx+5] = e->load/BAT_MAX_POWER_KW;
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef _MPC_H
+#define _MPC_H
+
+/*
+ * Projected gradient MPC kernel (chapter 2.3.2 of the documentation).
+ * Pure code on a flat array of decision variables: the uGrid copies its
+ * battery table in and out, the host harnesses call it directly.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include "constants.h"
+
+#define K_FACT          0.05f
+#define SOC_REF         0.5f
+#define LEARNING_RATE   0.1f
+#define PGD_ITERATIONS  100
+
+// role of a battery in the optimization
+typedef enum {
+    MPC_OFF,      // inactive or isolated: ignored
+    MPC_FIXED,    // objective imposed by the RCA: contributes, not optimized
+    MPC_FREE      // optimized
+} mpc_mode_t;
+
+typedef struct {
+    float soc;
+    float soh;        // used by the clustered solve only
+    float u;          // warm start in, optimum out [kW]
+    float fixed_u;    // command when MPC_FIXED [kW]
+    uint8_t mode;     // mpc_mode_t
+    uint8_t cluster;  // out of mpc_pgd_clustered()
+} mpc_var_t;
+
+typedef struct {
+    float alpha;
+    float beta;
+    float gama;
+    float price;
+    // hierarchical coupling towards a fleet setpoint
+    bool  coord_active;
+    float coord_setpoint;
+    float coord_weight;
+    // SoC target of the quadratic SoC term (SOC_REF, raised to reserve energy)
+    float soc_ref;
+    // peak shaving: w * max(0, net_load + sum(u) - peak_limit)^2
+    float peak_weight;    // 0 disables the term
+    float peak_limit;     // billing-period peak to defend [kW]
+    float net_load;       // forecast load - PV [kW]
+} mpc_params_t;
+
+/*
+ * PV curtailment as an extra decision variable c in [0, avail]: curtailing
+ * raises the grid balance by c at a linear cost, an export beyond the cap
+ * is penalized as EXPORT_WEIGHT * max(0, -(net_load + sum(u) + c) - cap)^2.
+ * After the iterations the plan meets the cap exactly by curtailing more, as
+ * long as there is PV left to curtail (zero-export sites). The curtailment
+ * is planned on the forecast: the node enforces the cap on the inverter
+ * from measured load and commanded battery power.
+ */
+#define EXPORT_WEIGHT   1.0f
+#define CURTAIL_COST    0.05f   // value of a curtailed kWh, below the price
+
+typedef struct {
+    float avail;          // forecast PV that can be curtailed [kW]
+    float export_cap;     // max export [kW], < 0 means no cap
+    float curtail;        // warm start in, setpoint out [kW]
+} mpc_pv_t;
+
+// w: batteries represented by each variable (NULL = one each)
+static inline float mpc_fleet_u(const mpc_var_t *v, const float *w, int n) {
+    float fleet_u = 0.0f;
+    for (int i = 0; i < n; i++) {
+        if (v[i].mode == MPC_OFF) continue;
+        float u = v[i].mode == MPC_FIXED ? v[i].fixed_u : v[i].u;
+        fleet_u += w ? w[i] * u : u;
+    }
+    return fleet_u;
+}
+
+// gradient of the per-battery terms (price, effort, SoC tracking)
+static inline float mpc_own_grad(const mpc_var_t *v, const mpc_params_t *p) {
+    float soc_term = v->soc + (K_FACT * v->u) - p->soc_ref;
+    return (p->alpha * p->price) + (2.0f * p->beta * v->u) + (2.0f * p->gama * K_FACT * soc_term);
+}
+
+/*
+ * Weighted PGD: a variable of weight w stands for w identical batteries,
+ * so it counts w times in the fleet terms. The per-battery step is the
+ * same (cost and gradient both scale by w).
+ *
+ * The fleet terms couple every battery: their curvature along the common
+ * direction grows with the fleet size (2 * sum(w) * weight), so a plain step
+ * of LEARNING_RATE diverges beyond a handful of batteries. The step is
+ * preconditioned with the Hessian of the active terms, a*I + f*1*w^T
+ * (a = per-battery curvature, f = active fleet curvature), inverted in
+ * closed form (Sherman-Morrison): the common mode is damped by
+ * a / (a + f*sum(w)), differences between batteries keep the plain step.
+ * Every mode then contracts by 1 - LEARNING_RATE*a, whatever the fleet size,
+ * and with no fleet term active the iteration is the plain PGD.
+ */
+static inline void mpc_pgd_weighted(mpc_var_t *v, const float *w, int n, const mpc_params_t *p,
+                                    mpc_pv_t *pv, int iterations) {
+    bool capped = pv != NULL && pv->export_cap >= 0.0f;
+    if (pv != NULL && !capped) pv->curtail = 0.0f;
+
+    const float a = 2.0f * p->beta + 2.0f * p->gama * K_FACT * K_FACT;
+    float w_free = 0.0f;
+    for (int i = 0; i < n; i++) {
+        if (v[i].mode == MPC_FREE) w_free += w ? w[i] : 1.0f;
+    }
+
+    for (int iter = 0; iter < iterations; iter++) {
+
+        // fleet-wide terms share the same gradient for every battery
+        float fleet_grad = 0.0f;
+        float fleet_curv = 0.0f;
+        if (p->coord_active || p->peak_weight > 0.0f || capped) {
+            float fleet_u = mpc_fleet_u(v, w, n);
+            if (p->coord_active) {
+                fleet_grad += 2.0f * p->coord_weight * (fleet_u - p->coord_setpoint);
+                fleet_curv += 2.0f * p->coord_weight;
+            }
+            float excess = p->net_load + fleet_u - p->peak_limit;
+            if (p->peak_weight > 0.0f && excess > 0.0f) {
+                fleet_grad += 2.0f * p->peak_weight * excess;
+                fleet_curv += 2.0f * p->peak_weight;
+            }
+            if (capped) {
+                float over = -(p->net_load + fleet_u + pv->curtail) - pv->export_cap;
+                float export_grad = over > 0.0f ? -2.0f * EXPORT_WEIGHT * over : 0.0f;
+                fleet_grad += export_grad;
+                if (over > 0.0f) fleet_curv += 2.0f * EXPORT_WEIGHT;
+
+                float c = pv->curtail - LEARNING_RATE * (CURTAIL_COST + export_grad);
+                if (c < 0.0f) c = 0.0f;
+                if (c > pv->avail) c = pv->avail;
+                pv->curtail = c;
+            }
+        }
+
+        // common-mode correction: f * (w^T g) / (a + f * sum(w))
+        float common = 0.0f;
+        if (fleet_curv > 0.0f) {
+            float wg = 0.0f;
+            for (int i = 0; i < n; i++) {
+                if (v[i].mode != MPC_FREE) continue;
+                wg += (w ? w[i] : 1.0f) * (mpc_own_grad(&v[i], p) + fleet_grad);
+            }
+            common = fleet_curv * wg / (a + fleet_curv * w_free);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (v[i].mode != MPC_FREE) continue;
+
+            float grad = mpc_own_grad(&v[i], p) + fleet_grad - common;
+            float u = v[i].u - (LEARNING_RATE * grad);
+            if (u > BAT_MAX_POWER_KW)  u = BAT_MAX_POWER_KW;
+            if (u < -BAT_MAX_POWER_KW) u = -BAT_MAX_POWER_KW;
+
+            v[i].u = u;
+        }
+    }
+
+    // planned export cap: whatever the batteries could not absorb is curtailed
+    if (capped) {
+        float over = -(p->net_load + mpc_fleet_u(v, w, n) + pv->curtail) - pv->export_cap;
+        if (over > 0.0f) {
+            pv->curtail += over;
+            if (pv->curtail > pv->avail) pv->curtail = pv->avail;
+        }
+    }
+}
+
+// pv may be NULL when the site has no curtailable PV / export limit
+static inline void mpc_pgd(mpc_var_t *v, int n, const mpc_params_t *p, mpc_pv_t *pv, int iterations) {
+    mpc_pgd_weighted(v, NULL, n, p, pv, iterations);
+}
+
+/*
+ * State-aware aggregation for large fleets: free batteries falling in the
+ * same (SoC, SoH) bin become one virtual battery, the fixed ones collapse
+ * into a single fixed contribution. The PGD runs on the clusters, then each
+ * cluster power is split over its members in proportion to their energy
+ * headroom in the direction of the command. Power limits are the same for
+ * every battery (BAT_MAX_POWER_KW), so they do not enter the key.
+ * Returns the number of virtual batteries solved.
+ */
+#define MPC_CLUSTER_SOC_STEP  0.05f
+#define MPC_CLUSTER_SOH_STEP  0.05f
+#define MPC_MAX_CLUSTERS      16
+
+static inline int mpc_cluster_key(float x, float step) {
+    return (int)(x / step);
+}
+
+static inline float mpc_headroom(const mpc_var_t *v, float total) {
+    return total >= 0.0f ? (1.0f - v->soc) * v->soh : v->soc * v->soh;
+}
+
+/*
+ * Water-filling split of the cluster power total over the members of
+ * cluster c: shares by headroom, the part clipped at BAT_MAX_POWER_KW goes
+ * to the members not saturated yet. The cluster power never exceeds
+ * members * BAT_MAX_POWER_KW (the PGD clamps it per battery), so the
+ * members deliver exactly the power the fleet terms were solved with; each
+ * pass saturates at least one more member or places the whole residual.
+ */
+static inline void mpc_split_cluster(mpc_var_t *v, int n, int c, float total) {
+    for (int i = 0; i < n; i++) {
+        if (v[i].mode == MPC_FREE && v[i].cluster == c) v[i].u = 0.0f;
+    }
+    float rest = total;
+    for (int pass = 0; pass < n && fabsf(rest) > 1e-6f; pass++) {
+        float head_sum = 0.0f;
+        int open = 0;
+        for (int i = 0; i < n; i++) {
+            if (v[i].mode != MPC_FREE || v[i].cluster != c) continue;
+            if (fabsf(v[i].u) >= BAT_MAX_POWER_KW) continue;
+            head_sum += mpc_headroom(&v[i], total);
+            open++;
+        }
+        if (open == 0) break;
+
+        float placed = 0.0f;
+        for (int i = 0; i < n; i++) {
+            if (v[i].mode != MPC_FREE || v[i].cluster != c) continue;
+            if (fabsf(v[i].u) >= BAT_MAX_POWER_KW) continue;
+            float share = head_sum > 0.0f ? mpc_headroom(&v[i], total) / head_sum : 1.0f / open;
+            float u = v[i].u + rest * share;
+            if (u > BAT_MAX_POWER_KW)  u = BAT_MAX_POWER_KW;
+            if (u < -BAT_MAX_POWER_KW) u = -BAT_MAX_POWER_KW;
+            placed += u - v[i].u;
+            v[i].u = u;
+        }
+        rest -= placed;
+    }
+}
+
+static inline int mpc_pgd_clustered(mpc_var_t *v, int n, const mpc_params_t *p,
+                                    mpc_pv_t *pv, int iterations) {
+    mpc_var_t cv[MPC_MAX_CLUSTERS + 1];
+    float cw[MPC_MAX_CLUSTERS + 1];
+    int ksoc[MPC_MAX_CLUSTERS], ksoh[MPC_MAX_CLUSTERS];
+    int nc = 0;
+
+    // slot MPC_MAX_CLUSTERS: all the fixed commands as one contribution
+    mpc_var_t *fixed = &cv[MPC_MAX_CLUSTERS];
+    fixed->soc = 0.0f;
+    fixed->u = 0.0f;
+    fixed->fixed_u = 0.0f;
+    fixed->mode = MPC_OFF;
+
+    for (int i = 0; i < n; i++) {
+        if (v[i].mode == MPC_FIXED) {
+            fixed->fixed_u += v[i].fixed_u;
+            fixed->mode = MPC_FIXED;
+        }
+        if (v[i].mode != MPC_FREE) continue;
+
+        int a = mpc_cluster_key(v[i].soc, MPC_CLUSTER_SOC_STEP);
+        int b = mpc_cluster_key(v[i].soh, MPC_CLUSTER_SOH_STEP);
+        int c = 0;
+        while (c < nc && (ksoc[c] != a || ksoh[c] != b)) c++;
+
+        if (c == nc && nc == MPC_MAX_CLUSTERS) {
+            // out of clusters: join the closest one in SoC
+            float best = 2.0f;
+            for (int k = 0; k < nc; k++) {
+                float d = fabsf(cv[k].soc / cw[k] - v[i].soc);
+                if (d < best) { best = d; c = k; }
+            }
+        } else if (c == nc) {
+            ksoc[c] = a;
+            ksoh[c] = b;
+            cv[c].soc = 0.0f;
+            cv[c].u = 0.0f;
+            cv[c].fixed_u = 0.0f;
+            cv[c].mode = MPC_FREE;
+            cw[c] = 0.0f;
+            nc++;
+        }
+        // sums for now, turned into means below
+        cv[c].soc += v[i].soc;
+        cv[c].u += v[i].u;
+        cw[c] += 1.0f;
+        v[i].cluster = (uint8_t)c;
+    }
+
+    for (int c = 0; c < nc; c++) {
+        cv[c].soc /= cw[c];
+        cv[c].u /= cw[c];
+    }
+    cv[nc] = *fixed;
+    cw[nc] = 1.0f;
+
+    mpc_pgd_weighted(cv, cw, nc + 1, p, pv, iterations);
+
+    // disaggregation: share of the cluster power by energy headroom
+    for (int c = 0; c < nc; c++) {
+        mpc_split_cluster(v, n, c, cv[c].u * cw[c]);
+    }
+    return nc;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _MQTTSN_H
+#define _MQTTSN_H
+
+/*
+ * Minimal MQTT-SN v1.2 publisher: QoS -1 PUBLISH on a predefined topic id,
+ * no CONNECT / REGISTER / keepalive. The node just sends datagrams to the
+ * gateway, which maps the topic id to an MQTT topic and forwards to the
+ * broker (RCA/mqttsn_gateway.py is the stand-in used in the lab).
+ *
+ *   PUBLISH: Length | MsgType 0x0C | Flags | TopicId (2) | MsgId (2) | Data
+ *   Length is 1 byte, or 0x01 + 2 bytes when the message exceeds 255 bytes
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define MQTTSN_PUBLISH            0x0C
+#define MQTTSN_FLAG_QOS_M1        0x60
+#define MQTTSN_FLAG_TOPIC_PREDEF  0x01
+#define MQTTSN_DEFAULT_PORT       1884
+
+// header bytes in front of the data (3-byte length form)
+#define MQTTSN_PUBLISH_HDR_MAX    9
+// largest payload published, well inside one IPv6 MTU
+#ifndef MQTTSN_MAX_DATA
+#define MQTTSN_MAX_DATA           512
+#endif
+
+/*
+ * Writes the PUBLISH header for data_len bytes of data into buf and returns
+ * its size: the data must follow at buf + returned size. Returns 0 if the
+ * message would not fit in 16 bits.
+ */
+static inline int mqttsn_publish_header(uint8_t *buf, uint16_t topic_id, uint16_t data_len) {
+    uint32_t len = 7u + data_len;   // Length counts itself
+    int i = 0;
+
+    if (len <= 255) {
+        buf[i++] = (uint8_t)len;
+    } else {
+        len += 2;
+        if (len > 0xFFFF) return 0;
+        buf[i++] = 0x01;
+        buf[i++] = (uint8_t)(len >> 8);
+        buf[i++] = (uint8_t)len;
+    }
+    buf[i++] = MQTTSN_PUBLISH;
+    buf[i++] = MQTTSN_FLAG_QOS_M1 | MQTTSN_FLAG_TOPIC_PREDEF;
+    buf[i++] = (uint8_t)(topic_id >> 8);
+    buf[i++] = (uint8_t)topic_id;
+    buf[i++] = 0;   // MsgId: unused with QoS -1
+    buf[i++] = 0;
+    return i;
+}
+
+void mqttsn_init(void);
+int  mqttsn_publish(uint16_t topic_id, const uint8_t *data, uint16_t data_len);
+
+#endif
@@ -5,6 +5,9 @@
 
 #define COAP_OBSERVE_CLIENT 1
 
+// Energest accounting (LPM residency reported by the battery node)
+#define ENERGEST_CONF_ON 1
+
 #undef COAP_MAX_CHUNK_SIZE
 #define COAP_MAX_CHUNK_SIZE 256
 
@@ -14,4 +17,13 @@
 // #define BATTERY_EP "coap://[fd00::203:3:3:3]:5683" // /dev/tty.usbmodemD82EA79297A21
 #define BATTERY_EP "coap://[fd00::f6ce:362e:a297:92a7]:5683" 
 
+// MQTT-SN gateway for the uGrid state uplink (make MQTTSN=1), one topic id per
+// uGrid: set per build with make MQTTSN=1 MQTTSN_TOPIC=<id> [MQTTSN_GW=<addr>]
+#ifndef MQTTSN_GW_ADDR
+#define MQTTSN_GW_ADDR "fd00::1"
+#endif
+#ifndef MQTTSN_TOPIC_STATE
+#define MQTTSN_TOPIC_STATE 1
+#endif
+
 #endif
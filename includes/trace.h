@@ -0,0 +1,95 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Chrome trace-event instrumentation (chrome://tracing, ui.perfetto.dev).
+ * Enabled only on native builds with TRACE_CONF_ENABLED (make TRACE=1):
+ * every span becomes a complete ("X") event in trace-<pid>.json, so spans
+ * that cross a protothread yield or interleave with callbacks still render
+ * correctly. On every other build the macros compile to nothing.
+ *
+ * State is static: include from one translation unit per firmware (the
+ * controller main file).
+ *
+ *   static trace_ts_t span_pgd;
+ *   TRACE_BEGIN(span_pgd);  ...  TRACE_END(span_pgd, "pgd");
+ */
+
+#include <stdint.h>
+
+typedef uint64_t trace_ts_t;
+
+#ifndef TRACE_CONF_ENABLED
+#define TRACE_CONF_ENABLED 0
+#endif
+
+#if TRACE_CONF_ENABLED && !defined(CONTIKI_TARGET_NATIVE)
+#warning "TRACE_CONF_ENABLED ignored: trace export needs TARGET=native"
+#endif
+
+#if TRACE_CONF_ENABLED && defined(CONTIKI_TARGET_NATIVE)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static FILE *trace_fp = NULL;
+
+static inline trace_ts_t trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (trace_ts_t)ts.tv_sec * 1000000ULL + (trace_ts_t)(ts.tv_nsec / 1000);
+}
+
+static void trace_close(void) {
+    if(trace_fp) {
+        // closing object keeps the array valid JSON after the trailing comma
+        fprintf(trace_fp, "{}]\n");
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+}
+
+static inline void trace_init(const char *process_name) {
+    char path[32];
+    snprintf(path, sizeof(path), "trace-%d.json", (int)getpid());
+    trace_fp = fopen(path, "w");
+    if(!trace_fp) return;
+    fprintf(trace_fp, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"%s\"}},\n", (int)getpid(), process_name);
+    atexit(trace_close);
+}
+
+static inline void trace_complete(const char *name, trace_ts_t start) {
+    if(!trace_fp) return;
+    trace_ts_t end = trace_now_us();
+    fprintf(trace_fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+            "\"ts\":%llu,\"dur\":%llu},\n", name, (int)getpid(),
+            (unsigned long long)start, (unsigned long long)(end - start));
+}
+
+static inline void trace_counter(const char *name, long value) {
+    if(!trace_fp) return;
+    fprintf(trace_fp, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":%d,"
+            "\"ts\":%llu,\"args\":{\"v\":%ld}},\n", name, (int)getpid(),
+            (unsigned long long)trace_now_us(), value);
+}
+
+#define TRACE_INIT(proc)        trace_init(proc)
+#define TRACE_BEGIN(span)       ((span) = trace_now_us())
+#define TRACE_END(span, name)   trace_complete((name), (span))
+#define TRACE_COUNTER(name, v)  trace_counter((name), (long)(v))
+#define TRACE_FLUSH()           do { if(trace_fp) fflush(trace_fp); } while(0)
+
+#else
+
+#define TRACE_INIT(proc)
+#define TRACE_BEGIN(span)       ((void)(span))
+#define TRACE_END(span, name)   ((void)(span))
+#define TRACE_COUNTER(name, v)
+#define TRACE_FLUSH()
+
+#endif
+
+#endif
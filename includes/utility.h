@@ -13,8 +13,11 @@ typedef enum {
     STATE_ISOLATED
 } battery_state_t;
 
-// maximum number of batteries
+// maximum number of batteries per uGrid controller
+// (in hierarchical mode each controller manages its own subset)
+#ifndef MAX_BATTERIES
 #define MAX_BATTERIES 5
+#endif
 typedef struct {
     uip_ipaddr_t ip;
     bool active;
@@ -31,8 +34,46 @@ typedef struct {
 
     bool  has_objective;
     float objective_power;
+    float head_up;            // kW above the current command (cached per cycle)
+    float head_down;          // kW below the current command
+    float event_u;            // command while a grid event is active [kW]
     uint32_t last_update_time;
+    uint32_t last_obs_seq;    // observe sequence of last notification
+    uint32_t obs_retry_at;    // clock_seconds() of next re-registration
+    uint8_t  obs_backoff;     // consecutive failed/stale re-registrations
+    bool     obs_stale;
     coap_observee_t *obs; 
 } battery_node_t;
 
+// control-cycle deadline accounting (uGrid)
+typedef struct {
+    uint32_t cycles;
+    uint32_t overruns;        // cycles longer than the period
+    uint32_t skipped;         // periods dropped to re-align the timer
+    uint32_t late_starts;     // timer fired more than one tick late
+    uint32_t last_ms;
+    uint32_t max_ms;
+    uint8_t  degrade_level;   // 0 normal, 1 reduced, 2 minimal
+} cycle_stats_t;
+
+// aggregate flexibility exported by a uGrid to the coordinator
+typedef struct {
+    float p_min;       // kW, most negative fleet power (max discharge)
+    float p_max;       // kW, most positive fleet power (max charge)
+    float energy_kwh;  // stored energy (SoC * SoH * capacity)
+    uint8_t n_active;
+} ugrid_flex_t;
+
+// grid event (frequency dip, demand response) served outside the MPC cycle
+typedef struct {
+    bool active;
+    float requested_kw;       // fleet power delta asked via /ctrl/event
+    float delta_kw;           // delta actually dispatched (within headroom)
+    uint16_t duration;        // s, then the fleet is handed back to the MPC
+    uint32_t expiry;          // clock_seconds()
+    clock_time_t t_rx;        // request received
+    uint32_t last_ms;         // request -> last command sent
+    uint32_t count;
+} grid_event_t;
+
 #endif
@@ -0,0 +1,508 @@
+/*
+ * Golden-trace equivalence harness for the controller kernels.
+ *
+ *   golden record <trace>   run the reference scenario, store every kernel
+ *                           input/output and the reference timings
+ *   golden replay <trace>   run this build's kernels on the recorded inputs,
+ *                           compare outputs with per-signal tolerances and
+ *                           report the speedup against the reference
+ *
+ * Kernels: power_predictor_regress(), battery_soh_regress(), mpc_pgd()
+ * (run_mpc), battery_derate_power() + battery_physics_step(). Physics is
+ * also replayed closed-loop per battery to expose accumulated drift.
+ *
+ * Build the reference and the candidate from the same tree with different
+ * flags (see Makefile: make check ALT_CFLAGS=...). Exit status is non-zero
+ * when a tolerance is violated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "constants.h"
+#include "env_model.h"
+#include "mpc.h"
+#include "battery_physics.h"
+#include "power_predictor_model.h"
+#include "battery_soh_model.h"
+
+#define GOLD_MAGIC       "GLD1"
+#define GOLD_BATTERIES   5
+#define GOLD_CYCLES      2000
+#define GOLD_SEED        12345u
+#define GOLD_BENCH_REPS  20
+
+/* ---------------------------------------------------------------------- */
+/* records                                                                 */
+/* ---------------------------------------------------------------------- */
+
+typedef struct {
+    float in[ML_PRED_WINDOW * N_PRED_FEAT];
+    float out[2];
+} pred_rec_t;
+
+typedef struct {
+    float in[ML_WINDOW * N_FEATURES];
+    float out[1];
+} soh_rec_t;
+
+typedef struct {
+    int32_t n;
+    int32_t iterations;
+    mpc_params_t p;
+    mpc_var_t in[GOLD_BATTERIES];
+    mpc_pv_t pv;                    // curtail = warm start
+    float u_out[GOLD_BATTERIES];
+    float curtail_out;
+} mpc_rec_t;
+
+typedef struct {
+    int32_t bat;
+    float power;                    // setpoint before derating [W]
+    float noise[PHYS_NOISE_COUNT];
+    float derated;
+    battery_phys_t in;
+    battery_phys_t out;
+} phys_rec_t;
+
+enum { K_PRED, K_SOH, K_MPC, K_PHYS, K_COUNT };
+static const char *kernel_names[K_COUNT] = { "predictor", "soh", "mpc", "physics" };
+
+typedef struct {
+    char magic[4];
+    uint32_t rec_size[K_COUNT];     // layout check between builds
+    uint32_t count[K_COUNT];
+    double ref_ns[K_COUNT];         // reference ns per call
+} gold_header_t;
+
+typedef struct {
+    void *data;
+    uint32_t count, cap, size;
+} vec_t;
+
+static vec_t recs[K_COUNT];
+
+static void *vec_push(vec_t *v) {
+    if (v->count == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 256;
+        v->data = realloc(v->data, (size_t)v->cap * v->size);
+        if (!v->data) { perror("realloc"); exit(2); }
+    }
+    return (char *)v->data + (size_t)v->count++ * v->size;
+}
+
+#define REC(k, type, i) (((type *)recs[k].data)[i])
+
+/* ---------------------------------------------------------------------- */
+/* tolerances: |alt - ref| <= abs + rel * |ref|                            */
+/* ---------------------------------------------------------------------- */
+
+typedef struct {
+    const char *name;
+    double abs, rel;
+    double max_err;
+    uint32_t checked, failed;
+} signal_t;
+
+static signal_t signals[] = {
+    { "pred.pv",       0.05,  0.0  },   // kW
+    { "pred.load",     0.05,  0.0  },   // kW
+    { "soh.ml",        0.5,   0.0  },   // percent
+    { "mpc.u",         0.01,  0.0  },   // kW
+    { "mpc.curtail",   0.01,  0.0  },   // kW
+    { "phys.derated",  1.0,   1e-3 },   // W
+    { "phys.voltage",  0.005, 0.0  },   // V
+    { "phys.current",  0.05,  1e-3 },   // A
+    { "phys.temp",     0.05,  0.0  },   // degC
+    { "phys.soc",      1e-4,  0.0  },
+    { "phys.soh",      1e-4,  0.0  },
+    { "drift.soc",     0.01,  0.0  },   // closed loop, end of run
+    { "drift.soh",     0.005, 0.0  },
+};
+#define N_SIGNALS (sizeof(signals) / sizeof(signals[0]))
+
+static signal_t *sig(const char *name) {
+    for (size_t i = 0; i < N_SIGNALS; i++) {
+        if (strcmp(signals[i].name, name) == 0) return &signals[i];
+    }
+    fprintf(stderr, "unknown signal %s\n", name);
+    exit(2);
+}
+
+static void check(signal_t *s, double ref, double alt) {
+    double err = fabs(alt - ref);
+    if (!(err == err)) err = INFINITY;  // NaN
+    if (err > s->max_err) s->max_err = err;
+    s->checked++;
+    if (err > s->abs + s->rel * fabs(ref)) s->failed++;
+}
+
+/* ---------------------------------------------------------------------- */
+/* deterministic randomness (random_rand compatible)                       */
+/* ---------------------------------------------------------------------- */
+
+static uint32_t rng_state = GOLD_SEED;
+
+static unsigned short gold_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (unsigned short)(rng_state >> 16);
+}
+
+// same distribution as get_random_noise(1.0f) on the node
+static float unit_noise(void) {
+    return (gold_rand() % 100) / 50.0f - 1.0f;
+}
+
+/* ---------------------------------------------------------------------- */
+/* kernel wrappers (one call = one record)                                 */
+/* ---------------------------------------------------------------------- */
+
+static void run_pred(const pred_rec_t *r, float *out) {
+    power_predictor_regress(r->in, ML_PRED_WINDOW * N_PRED_FEAT, out, 2);
+}
+
+static void run_soh(const soh_rec_t *r, float *out) {
+    battery_soh_regress(r->in, ML_WINDOW * N_FEATURES, out, 1);
+}
+
+static void run_mpc(const mpc_rec_t *r, float *u_out, float *curtail_out) {
+    mpc_var_t v[GOLD_BATTERIES];
+    mpc_pv_t pv = r->pv;
+    memcpy(v, r->in, sizeof(v));
+    mpc_pgd(v, r->n, &r->p, &pv, r->iterations);
+    for (int i = 0; i < r->n; i++) u_out[i] = v[i].u;
+    *curtail_out = pv.curtail;
+}
+
+static void run_phys(const phys_rec_t *r, float *derated, battery_phys_t *out) {
+    *out = r->in;
+    *derated = battery_derate_power(r->in.soc, r->power);
+    battery_physics_step(out, *derated, r->noise);
+}
+
+/* ---------------------------------------------------------------------- */
+/* reference scenario                                                      */
+/* ---------------------------------------------------------------------- */
+
+static void scenario(void) {
+    env_state_t env = ENV_STATE_INIT;
+    float features[ML_PRED_WINDOW * N_PRED_FEAT] = { 0 };
+
+    battery_phys_t bat[GOLD_BATTERIES];
+    float ml_buf[GOLD_BATTERIES][ML_WINDOW * N_FEATURES];
+    float u[GOLD_BATTERIES] = { 0 };
+    float curtail = 0.0f;
+    static const float soc0[GOLD_BATTERIES] = { 0.8f, 0.5f, 0.2f, 0.95f, 0.05f };
+
+    for (int b = 0; b < GOLD_BATTERIES; b++) {
+        battery_phys_t init = BATTERY_PHYS_INIT;
+        bat[b] = init;
+        bat[b].soc = soc0[b];
+        memset(ml_buf[b], 0, sizeof(ml_buf[b]));
+    }
+
+    for (int cycle = 0; cycle < GOLD_CYCLES; cycle++) {
+        env_step(&env, gold_rand);
+        env_push_features(&env, features);
+
+        pred_rec_t *pr = vec_push(&recs[K_PRED]);
+        memcpy(pr->in, features, sizeof(pr->in));
+        run_pred(pr, pr->out);
+
+        // exercise every optimizer path: objectives, isolation, coordination
+        // and the degraded iteration counts
+        mpc_rec_t *mr = vec_push(&recs[K_MPC]);
+        memset(mr, 0, sizeof(*mr));
+        mr->n = GOLD_BATTERIES;
+        mr->iterations = PGD_ITERATIONS >> (cycle % 7 == 0 ? 2 : cycle % 5 == 0 ? 1 : 0);
+        mr->p.alpha = 1.0f;
+        mr->p.beta = 1.0f;
+        mr->p.gama = 20.0f;
+        mr->p.price = (cycle / 50) % 2 ? 0.40f : 0.25f;
+        mr->p.coord_active = (cycle / 100) % 2;
+        mr->p.coord_setpoint = pr->out[0] - pr->out[1];
+        mr->p.coord_weight = 0.5f;
+        mr->p.soc_ref = SOC_REF;
+        mr->p.peak_weight = (cycle / 150) % 2 ? 2.0f : 0.0f;
+        mr->p.peak_limit = 3.0f;
+        mr->p.net_load = pr->out[1] - pr->out[0];
+        mr->pv.avail = pr->out[0];
+        mr->pv.export_cap = (cycle / 120) % 3 == 0 ? -1.0f : (cycle / 120) % 3 == 1 ? 0.0f : 1.5f;
+        mr->pv.curtail = curtail;
+        for (int b = 0; b < GOLD_BATTERIES; b++) {
+            mr->in[b].soc = bat[b].soc;
+            mr->in[b].soh = bat[b].soh;
+            mr->in[b].u = u[b];
+            mr->in[b].fixed_u = -2.0f;
+            mr->in[b].mode = MPC_FREE;
+        }
+        if ((cycle / 200) % 3 == 1) mr->in[1].mode = MPC_FIXED;
+        if ((cycle / 300) % 4 == 2) mr->in[4].mode = MPC_OFF;
+        run_mpc(mr, mr->u_out, &mr->curtail_out);
+        curtail = mr->curtail_out;
+
+        for (int b = 0; b < GOLD_BATTERIES; b++) {
+            float cmd_kw = mr->in[b].mode == MPC_FIXED ? mr->in[b].fixed_u : mr->u_out[b];
+            if (mr->in[b].mode != MPC_OFF) u[b] = mr->u_out[b];
+
+            phys_rec_t *ph = vec_push(&recs[K_PHYS]);
+            ph->bat = b;
+            ph->power = mr->in[b].mode == MPC_OFF ? 0.0f : cmd_kw * 1000.0f;
+            for (int k = 0; k < PHYS_NOISE_COUNT; k++) ph->noise[k] = unit_noise();
+            ph->in = bat[b];
+            run_phys(ph, &ph->derated, &ph->out);
+            bat[b] = ph->out;
+
+            battery_push_features(&bat[b], ml_buf[b]);
+            soh_rec_t *sr = vec_push(&recs[K_SOH]);
+            memcpy(sr->in, ml_buf[b], sizeof(sr->in));
+            run_soh(sr, sr->out);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* timing                                                                  */
+/* ---------------------------------------------------------------------- */
+
+static volatile float sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// best-of-N ns per call over all records of a kernel
+static double bench(int k) {
+    double best = INFINITY;
+    uint32_t n = recs[k].count;
+    if (n == 0) return 0.0;
+
+    for (int rep = 0; rep < GOLD_BENCH_REPS; rep++) {
+        double t0 = now_ns();
+        for (uint32_t i = 0; i < n; i++) {
+            float out[GOLD_BATTERIES] = { 0 };
+            battery_phys_t st;
+            switch (k) {
+            case K_PRED: run_pred(&REC(K_PRED, pred_rec_t, i), out); break;
+            case K_SOH:  run_soh(&REC(K_SOH, soh_rec_t, i), out); break;
+            case K_MPC:  run_mpc(&REC(K_MPC, mpc_rec_t, i), out, &out[0]); break;
+            case K_PHYS: run_phys(&REC(K_PHYS, phys_rec_t, i), out, &st); out[0] += st.soc; break;
+            }
+            sink = out[0];
+        }
+        double dt = (now_ns() - t0) / n;
+        if (dt < best) best = dt;
+    }
+    return best;
+}
+
+/* ---------------------------------------------------------------------- */
+/* trace file                                                              */
+/* ---------------------------------------------------------------------- */
+
+static const uint32_t rec_sizes[K_COUNT] = {
+    sizeof(pred_rec_t), sizeof(soh_rec_t), sizeof(mpc_rec_t), sizeof(phys_rec_t)
+};
+
+static void init_vecs(void) {
+    for (int k = 0; k < K_COUNT; k++) {
+        memset(&recs[k], 0, sizeof(recs[k]));
+        recs[k].size = rec_sizes[k];
+    }
+}
+
+static int save(const char *path) {
+    gold_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, GOLD_MAGIC, 4);
+    for (int k = 0; k < K_COUNT; k++) {
+        h.rec_size[k] = rec_sizes[k];
+        h.count[k] = recs[k].count;
+        h.ref_ns[k] = bench(k);
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f) { perror(path); return 2; }
+    fwrite(&h, sizeof(h), 1, f);
+    for (int k = 0; k < K_COUNT; k++) {
+        fwrite(recs[k].data, recs[k].size, recs[k].count, f);
+    }
+    fclose(f);
+
+    printf("recorded %s:", path);
+    for (int k = 0; k < K_COUNT; k++) {
+        printf(" %s=%u (%.0f ns)", kernel_names[k], h.count[k], h.ref_ns[k]);
+    }
+    printf("\n");
+    return 0;
+}
+
+static int load(const char *path, gold_header_t *h) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { perror(path); return 2; }
+    if (fread(h, sizeof(*h), 1, f) != 1 || memcmp(h->magic, GOLD_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not a golden trace\n", path);
+        fclose(f);
+        return 2;
+    }
+    for (int k = 0; k < K_COUNT; k++) {
+        if (h->rec_size[k] != rec_sizes[k]) {
+            fprintf(stderr, "%s: %s record layout differs from this build, re-record\n",
+                    path, kernel_names[k]);
+            fclose(f);
+            return 2;
+        }
+        recs[k].cap = recs[k].count = h->count[k];
+        recs[k].data = malloc((size_t)h->count[k] * recs[k].size + 1);
+        if (fread(recs[k].data, recs[k].size, h->count[k], f) != h->count[k]) {
+            fprintf(stderr, "%s: truncated\n", path);
+            fclose(f);
+            return 2;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* replay                                                                  */
+/* ---------------------------------------------------------------------- */
+
+static void compare_all(void) {
+    for (uint32_t i = 0; i < recs[K_PRED].count; i++) {
+        const pred_rec_t *r = &REC(K_PRED, pred_rec_t, i);
+        float out[2];
+        run_pred(r, out);
+        check(sig("pred.pv"), r->out[0], out[0]);
+        check(sig("pred.load"), r->out[1], out[1]);
+    }
+
+    for (uint32_t i = 0; i < recs[K_SOH].count; i++) {
+        const soh_rec_t *r = &REC(K_SOH, soh_rec_t, i);
+        float out[1];
+        run_soh(r, out);
+        check(sig("soh.ml"), r->out[0], out[0]);
+    }
+
+    for (uint32_t i = 0; i < recs[K_MPC].count; i++) {
+        const mpc_rec_t *r = &REC(K_MPC, mpc_rec_t, i);
+        float u[GOLD_BATTERIES], c;
+        run_mpc(r, u, &c);
+        for (int b = 0; b < r->n; b++) check(sig("mpc.u"), r->u_out[b], u[b]);
+        check(sig("mpc.curtail"), r->curtail_out, c);
+    }
+
+    // open loop: every step starts from the recorded reference state
+    for (uint32_t i = 0; i < recs[K_PHYS].count; i++) {
+        const phys_rec_t *r = &REC(K_PHYS, phys_rec_t, i);
+        battery_phys_t st;
+        float derated;
+        run_phys(r, &derated, &st);
+        check(sig("phys.derated"), r->derated, derated);
+        check(sig("phys.voltage"), r->out.voltage, st.voltage);
+        check(sig("phys.current"), r->out.current, st.current);
+        check(sig("phys.temp"), r->out.temp, st.temp);
+        check(sig("phys.soc"), r->out.soc, st.soc);
+        check(sig("phys.soh"), r->out.soh, st.soh);
+    }
+
+    // closed loop: each battery evolves on its own state for the whole run
+    battery_phys_t cl[GOLD_BATTERIES], ref_end[GOLD_BATTERIES];
+    bool seen[GOLD_BATTERIES] = { false };
+    for (uint32_t i = 0; i < recs[K_PHYS].count; i++) {
+        const phys_rec_t *r = &REC(K_PHYS, phys_rec_t, i);
+        int b = r->bat;
+        if (b < 0 || b >= GOLD_BATTERIES) continue;
+        if (!seen[b]) { cl[b] = r->in; seen[b] = true; }
+        float derated = battery_derate_power(cl[b].soc, r->power);
+        battery_physics_step(&cl[b], derated, r->noise);
+        ref_end[b] = r->out;
+    }
+    for (int b = 0; b < GOLD_BATTERIES; b++) {
+        if (!seen[b]) continue;
+        check(sig("drift.soc"), ref_end[b].soc, cl[b].soc);
+        check(sig("drift.soh"), ref_end[b].soh, cl[b].soh);
+    }
+}
+
+static int report(const gold_header_t *h) {
+    int failed = 0;
+
+    printf("%-14s %12s %10s %10s %8s\n", "signal", "max_err", "tol_abs", "tol_rel", "fail");
+    for (size_t i = 0; i < N_SIGNALS; i++) {
+        signal_t *s = &signals[i];
+        if (s->checked == 0) continue;
+        printf("%-14s %12.3g %10.3g %10.3g %5u/%u%s\n", s->name, s->max_err,
+               s->abs, s->rel, s->failed, s->checked, s->failed ? "  FAIL" : "");
+        if (s->failed) failed = 1;
+    }
+
+    printf("\n%-10s %12s %12s %8s\n", "kernel", "ref ns", "this ns", "speedup");
+    for (int k = 0; k < K_COUNT; k++) {
+        double ns = bench(k);
+        printf("%-10s %12.0f %12.0f %7.2fx\n", kernel_names[k], h->ref_ns[k], ns,
+               ns > 0 ? h->ref_ns[k] / ns : 0.0);
+    }
+
+    printf("\n%s\n", failed ? "EQUIVALENCE FAILED" : "equivalent within tolerances");
+    return failed;
+}
+
+// --tol name=abs[,rel]
+static void parse_tol(const char *arg) {
+    char name[32];
+    double a, r;
+    const char *eq = strchr(arg, '=');
+    if (!eq || (size_t)(eq - arg) >= sizeof(name)) {
+        fprintf(stderr, "bad --tol %s\n", arg);
+        exit(2);
+    }
+    memcpy(name, arg, eq - arg);
+    name[eq - arg] = '\0';
+    signal_t *s = sig(name);
+    int n = sscanf(eq + 1, "%lf,%lf", &a, &r);
+    if (n >= 1) s->abs = a;
+    if (n == 2) s->rel = r;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s record <trace>\n"
+                    "       %s replay <trace> [--tol signal=abs[,rel]]...\n", argv0, argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) usage(argv[0]);
+    init_vecs();
+
+    if (strcmp(argv[1], "record") == 0) {
+        scenario();
+        return save(argv[2]);
+    }
+
+    if (strcmp(argv[1], "replay") == 0) {
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--tol") == 0 && i + 1 < argc) {
+                parse_tol(argv[++i]);
+            } else {
+                usage(argv[0]);
+            }
+        }
+        gold_header_t h;
+        int rc = load(argv[2], &h);
+        if (rc) return rc;
+        compare_all();
+        return report(&h);
+    }
+
+    usage(argv[0]);
+    return 2;
+}
@@ -0,0 +1,322 @@
+/*
+ * Monte Carlo robustness evaluation of the uGrid controller.
+ *
+ * Every scenario samples a weather regime (overcast probability, cloud
+ * volatility), load events and the aging state of each battery, then runs
+ * the same kernels as the firmware (env_model.h, mpc.h, battery_physics.h,
+ * SoH model + safety blend) for the requested number of days. Scenarios are
+ * spread over all cores; each one has its own seed derived from the run
+ * seed, so results do not depend on the thread count.
+ *
+ *   montecarlo [-n scenarios] [-d days] [-j threads] [-s seed] [-o out.csv] [-m]
+ *
+ * Reported per metric: mean with 95% confidence interval, p5/p50/p95, and
+ * the mean split by weather regime. SoH comes from the physics model; -m
+ * adds the ML SoH estimate through the node's safety blend. A run where
+ * (almost) every battery ends up isolated says nothing about the
+ * scenarios, so it exits with status 3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "env_model.h"
+#include "mpc.h"
+#include "battery_physics.h"
+#include "battery_soh_model.h"
+
+#define MC_BATTERIES      5
+#define MC_CYCLE_HOURS    0.5f      // env_step advances the clock by 30 min
+#define MC_PRICE          0.25f     // EUR/kWh, same default as ctrl/mpc
+#define MC_SOH_CRITICAL   0.65f     // isolation thresholds of the node
+#define MC_TEMP_CRITICAL  60.0f
+#define MC_ISOLATION_MAX  0.95      // isolated batteries / total that fails the run
+
+static int use_ml_blend = 0;
+
+/* ---------------------------------------------------------------------- */
+/* scenarios                                                               */
+/* ---------------------------------------------------------------------- */
+
+typedef struct {
+    const char *name;
+    int cloudy_pct;
+    float cloud_volatility;
+} regime_t;
+
+static const regime_t regimes[] = {
+    { "clear",     10, 0.10f },
+    { "mixed",     31, 0.15f },
+    { "overcast",  70, 0.20f },
+    { "stormy",    90, 0.30f },
+};
+#define N_REGIMES (int)(sizeof(regimes) / sizeof(regimes[0]))
+
+typedef struct {
+    int regime;
+    double cost;          // EUR of imported energy
+    double import_peak;   // kW
+    double soh_loss;      // mean over batteries
+    int isolations;
+} result_t;
+
+/* ---------------------------------------------------------------------- */
+/* per-thread randomness (random_rand compatible for env_model.h)          */
+/* ---------------------------------------------------------------------- */
+
+static __thread uint32_t rng_state;
+
+static unsigned short mc_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (unsigned short)(rng_state >> 16);
+}
+
+static float mc_uniform(float lo, float hi) {
+    return lo + (hi - lo) * (mc_rand() / 65535.0f);
+}
+
+static uint32_t scenario_seed(uint32_t seed, uint32_t i) {
+    uint64_t z = ((uint64_t)seed << 32) + i + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (uint32_t)z ? (uint32_t)z : 1u;
+}
+
+/* ---------------------------------------------------------------------- */
+/* one scenario                                                            */
+/* ---------------------------------------------------------------------- */
+
+static void run_scenario(uint32_t seed, int cycles, result_t *res) {
+    rng_state = seed;
+
+    int regime = mc_rand() % N_REGIMES;
+    env_params_t ep = ENV_PARAMS_DEFAULT;
+    ep.cloudy_pct = regimes[regime].cloudy_pct;
+    ep.cloud_volatility = regimes[regime].cloud_volatility;
+    ep.event_pct = 5 + mc_rand() % 26;
+    ep.event_scale = mc_uniform(0.5f, 2.0f);
+    ep.load_scale = mc_uniform(0.7f, 1.4f);
+
+    env_state_t env = ENV_STATE_INIT;
+
+    battery_phys_t bat[MC_BATTERIES];
+    float ml_buf[MC_BATTERIES][ML_WINDOW * N_FEATURES];
+    float soh0[MC_BATTERIES];
+    bool isolated[MC_BATTERIES];
+    mpc_var_t vars[MC_BATTERIES];
+
+    for (int b = 0; b < MC_BATTERIES; b++) {
+        battery_phys_t init = BATTERY_PHYS_INIT;
+        bat[b] = init;
+        bat[b].soc = mc_uniform(0.1f, 0.9f);
+        // prior aging goes into SoH only: charge_cycles is a per-step
+        // degradation term in battery_physics_step(), so it starts at 0
+        bat[b].soh = mc_uniform(0.70f, 1.0f);
+        bat[b].capacity_ah = SCALED_CAPACITY_AH * bat[b].soh;
+        soh0[b] = bat[b].soh;
+        isolated[b] = false;
+        memset(ml_buf[b], 0, sizeof(ml_buf[b]));
+        vars[b].u = 0.0f;
+        vars[b].fixed_u = 0.0f;
+    }
+
+    mpc_params_t mp = { 1.0f, 1.0f, 20.0f, MC_PRICE, false, 0.0f, 0.0f, SOC_REF, 0.0f, 0.0f, 0.0f };
+
+    memset(res, 0, sizeof(*res));
+    res->regime = regime;
+
+    for (int c = 0; c < cycles; c++) {
+        env_step_p(&env, &ep, mc_rand);
+
+        for (int b = 0; b < MC_BATTERIES; b++) {
+            vars[b].soc = bat[b].soc;
+            vars[b].soh = bat[b].soh;
+            vars[b].mode = isolated[b] ? MPC_OFF : MPC_FREE;
+        }
+        mpc_pgd(vars, MC_BATTERIES, &mp, NULL, PGD_ITERATIONS);
+
+        float batt_kw = 0.0f;
+        for (int b = 0; b < MC_BATTERIES; b++) {
+            if (isolated[b]) continue;
+
+            float noise[PHYS_NOISE_COUNT];
+            for (int k = 0; k < PHYS_NOISE_COUNT; k++) {
+                noise[k] = (mc_rand() % 100) / 50.0f - 1.0f;
+            }
+            float power = battery_derate_power(bat[b].soc, vars[b].u * 1000.0f);
+            battery_physics_step(&bat[b], power, noise);
+            batt_kw += power / 1000.0f;
+
+            if (use_ml_blend) {
+                battery_push_features(&bat[b], ml_buf[b]);
+                float ml_pct;
+                battery_soh_regress(ml_buf[b], ML_WINDOW * N_FEATURES, &ml_pct, 1);
+                bat[b].soh = battery_soh_blend(bat[b].soh, bat[b].temp, bat[b].soc, ml_pct);
+                bat[b].capacity_ah = SCALED_CAPACITY_AH * bat[b].soh;
+            }
+
+            if (bat[b].soh < MC_SOH_CRITICAL || bat[b].temp > MC_TEMP_CRITICAL) {
+                isolated[b] = true;
+                res->isolations++;
+            }
+        }
+
+        float grid = env.load - env.pv + batt_kw;
+        if (grid > 0.0f) {
+            res->cost += grid * MC_CYCLE_HOURS * MC_PRICE;
+            if (grid > res->import_peak) res->import_peak = grid;
+        }
+    }
+
+    for (int b = 0; b < MC_BATTERIES; b++) {
+        res->soh_loss += (soh0[b] - bat[b].soh) / MC_BATTERIES;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* parallel driver                                                         */
+/* ---------------------------------------------------------------------- */
+
+typedef struct {
+    int id, stride, n, cycles;
+    uint32_t seed;
+    result_t *results;
+} worker_t;
+
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    for (int i = w->id; i < w->n; i += w->stride) {
+        run_scenario(scenario_seed(w->seed, (uint32_t)i), w->cycles, &w->results[i]);
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+/* statistics                                                              */
+/* ---------------------------------------------------------------------- */
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    double pos = p * (n - 1);
+    int lo = (int)pos;
+    int hi = lo + 1 < n ? lo + 1 : lo;
+    return sorted[lo] + (sorted[hi] - sorted[lo]) * (pos - lo);
+}
+
+static void summarize(const char *name, const result_t *r, int n, size_t offset) {
+    double *v = malloc(sizeof(double) * n);
+    double sum = 0.0, sq = 0.0;
+    double rsum[N_REGIMES] = { 0 };
+    int rcnt[N_REGIMES] = { 0 };
+
+    for (int i = 0; i < n; i++) {
+        v[i] = *(const double *)((const char *)&r[i] + offset);
+        sum += v[i];
+        rsum[r[i].regime] += v[i];
+        rcnt[r[i].regime]++;
+    }
+    double mean = sum / n;
+    for (int i = 0; i < n; i++) sq += (v[i] - mean) * (v[i] - mean);
+    double sd = n > 1 ? sqrt(sq / (n - 1)) : 0.0;
+    double ci = 1.96 * sd / sqrt(n);
+
+    qsort(v, n, sizeof(double), cmp_double);
+    printf("%-12s %10.4f +/- %-9.4f %10.4f %10.4f %10.4f |", name, mean, ci,
+           percentile(v, n, 0.05), percentile(v, n, 0.50), percentile(v, n, 0.95));
+    for (int k = 0; k < N_REGIMES; k++) {
+        printf(" %9.4f", rcnt[k] ? rsum[k] / rcnt[k] : 0.0);
+    }
+    printf("\n");
+    free(v);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-n scenarios] [-d days] [-j threads] [-s seed] [-o out.csv] [-m]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int n = 2000, days = 7;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t seed = 1;
+    const char *csv = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:j:s:o:mh")) != -1) {
+        switch (opt) {
+        case 'n': n = atoi(optarg); break;
+        case 'd': days = atoi(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        case 's': seed = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'o': csv = optarg; break;
+        case 'm': use_ml_blend = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (n < 1 || days < 1) usage(argv[0]);
+    if (threads < 1) threads = 1;
+    if (threads > n) threads = n;
+
+    int cycles = (int)(days * 24 / MC_CYCLE_HOURS);
+    result_t *results = calloc(n, sizeof(result_t));
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    worker_t *ws = malloc(sizeof(worker_t) * threads);
+
+    for (int t = 0; t < threads; t++) {
+        ws[t] = (worker_t){ t, threads, n, cycles, seed, results };
+        pthread_create(&tids[t], NULL, worker, &ws[t]);
+    }
+    for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+
+    int isolations = 0;
+    for (int i = 0; i < n; i++) isolations += results[i].isolations;
+
+    printf("%d scenarios x %d days (%d cycles, %d batteries), %d threads, seed %u, SoH %s\n\n",
+           n, days, cycles, MC_BATTERIES, threads, seed, use_ml_blend ? "physics+ML" : "physics");
+    printf("%-12s %22s %10s %10s %10s |", "metric", "mean +/- 95% CI", "p5", "p50", "p95");
+    for (int k = 0; k < N_REGIMES; k++) printf(" %9s", regimes[k].name);
+    printf("\n");
+    summarize("cost_eur", results, n, offsetof(result_t, cost));
+    summarize("import_kw", results, n, offsetof(result_t, import_peak));
+    summarize("soh_loss", results, n, offsetof(result_t, soh_loss));
+    double iso_rate = (double)isolations / ((double)n * MC_BATTERIES);
+    printf("\nbattery isolations: %d (%.2f per scenario, %.1f%% of batteries)\n",
+           isolations, (double)isolations / n, 100.0 * iso_rate);
+
+    if (csv) {
+        FILE *f = fopen(csv, "w");
+        if (!f) { perror(csv); return 1; }
+        fprintf(f, "scenario,regime,cost_eur,import_peak_kw,soh_loss,isolations\n");
+        for (int i = 0; i < n; i++) {
+            fprintf(f, "%d,%s,%.6f,%.6f,%.6f,%d\n", i, regimes[results[i].regime].name,
+                    results[i].cost, results[i].import_peak, results[i].soh_loss,
+                    results[i].isolations);
+        }
+        fclose(f);
+    }
+
+    free(ws);
+    free(tids);
+    free(results);
+
+    if (iso_rate >= MC_ISOLATION_MAX) {
+        fprintf(stderr, "FAIL: %.1f%% of the batteries isolated, the distributions above are not "
+                "informative (SoH collapse)\n", 100.0 * iso_rate);
+        return 3;
+    }
+    return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Convergence check of mpc_pgd() / mpc_pgd_clustered() on fleets of 8, 16
+ * and 40 batteries with the fleet terms on (coordination, peak shaving,
+ * export cap), one at a time and all together. The "mixed" case puts the
+ * whole fleet in one SoC/SoH cluster with very different discharge
+ * headroom and asks for a deep discharge, so the cluster split saturates
+ * some members and has to move their excess to the others.
+ *
+ * The solver is run as on the node: PGD_ITERATIONS per control cycle, warm
+ * started from the previous cycle. A case passes when the fleet power has
+ * settled (no cycle-to-cycle swing) and it matches a reference optimum,
+ * computed with plain projected gradient at a step small enough for any
+ * fleet size (LEARNING_RATE / (1 + sum(w) * fleet curvature)) and many more
+ * iterations.
+ *
+ *   mpc_converge [-v]
+ *
+ * Exits with status 1 if any case fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "constants.h"
+#include "mpc.h"
+
+#define MC_MAX_BATTERIES  40
+#define MC_CYCLES         30
+#define MC_SETTLE_CYCLES  5       // last cycles that must not move
+#define MC_SETTLE_TOL     0.01f   // kW per battery, cycle to cycle
+#define MC_REF_ITER       200000
+#define MC_REF_TOL        0.05f   // kW per battery, against the reference
+#define MC_CLUSTER_TOL    0.25f   // clustering approximates the SoC term
+
+typedef enum { CASE_COORD, CASE_PEAK, CASE_EXPORT, CASE_ALL, CASE_MIXED, CASE_COUNT } case_t;
+static const char *case_name[CASE_COUNT] = { "coord", "peak", "export", "all", "mixed" };
+
+static void setup(case_t c, int n, mpc_var_t *v, mpc_params_t *p, mpc_pv_t *pv) {
+    for (int i = 0; i < n; i++) {
+        v[i].soc = 0.1f + 0.8f * (float)i / (float)(n - 1);
+        v[i].soh = 0.7f + 0.3f * (float)(i % 7) / 6.0f;
+        v[i].u = 0.0f;
+        v[i].fixed_u = 0.0f;
+        v[i].mode = MPC_FREE;
+        v[i].cluster = 0;
+        if (c == CASE_MIXED) {
+            // one (SoC, SoH) bin: discharge headroom from 0.005 to 0.045
+            v[i].soc = 0.005f + 0.04f * (float)i / (float)(n - 1);
+            v[i].soh = 0.96f;
+        }
+    }
+    // one battery on an RCA objective, one isolated
+    v[1].mode = MPC_FIXED;
+    v[1].fixed_u = -5.0f;
+    v[2].mode = MPC_OFF;
+
+    memset(p, 0, sizeof(*p));
+    p->alpha = 1.0f;
+    p->beta = 1.0f;
+    p->gama = 20.0f;
+    p->price = 0.25f;
+    p->soc_ref = SOC_REF;
+
+    pv->avail = 0.0f;
+    pv->export_cap = -1.0f;
+    pv->curtail = 0.0f;
+
+    if (c == CASE_COORD || c == CASE_ALL) {
+        p->coord_active = true;
+        p->coord_setpoint = -2.5f * n;
+        p->coord_weight = 0.5f;
+    }
+    if (c == CASE_MIXED) {
+        p->coord_active = true;
+        p->coord_setpoint = -8.0f * n;
+        p->coord_weight = 0.5f;
+    }
+    if (c == CASE_PEAK || c == CASE_ALL) {
+        p->peak_weight = 1.0f;
+        p->peak_limit = 1.0f * n;
+        p->net_load = 3.0f * n;
+    }
+    if (c == CASE_EXPORT || c == CASE_ALL) {
+        p->net_load = c == CASE_ALL ? 0.5f * n : -4.0f * n;
+        p->peak_limit = c == CASE_ALL ? p->peak_limit : 0.0f;
+        pv->avail = 5.0f * n;
+        pv->export_cap = 0.5f * n;
+    }
+}
+
+// reference: plain projected gradient on the full fleet, small fixed step
+static void reference(mpc_var_t *v, int n, const mpc_params_t *p, mpc_pv_t *pv) {
+    bool capped = pv->export_cap >= 0.0f;
+    float k = (p->coord_active ? p->coord_weight : 0.0f) + p->peak_weight + (capped ? EXPORT_WEIGHT : 0.0f);
+    float step = LEARNING_RATE / (1.0f + 2.0f * n * k);
+
+    for (int iter = 0; iter < MC_REF_ITER; iter++) {
+        float fleet_u = mpc_fleet_u(v, NULL, n);
+        float fleet_grad = 0.0f;
+        if (p->coord_active) fleet_grad += 2.0f * p->coord_weight * (fleet_u - p->coord_setpoint);
+        float excess = p->net_load + fleet_u - p->peak_limit;
+        if (p->peak_weight > 0.0f && excess > 0.0f) fleet_grad += 2.0f * p->peak_weight * excess;
+        if (capped) {
+            float over = -(p->net_load + fleet_u + pv->curtail) - pv->export_cap;
+            float export_grad = over > 0.0f ? -2.0f * EXPORT_WEIGHT * over : 0.0f;
+            fleet_grad += export_grad;
+            float c = pv->curtail - step * (CURTAIL_COST + export_grad);
+            pv->curtail = c < 0.0f ? 0.0f : (c > pv->avail ? pv->avail : c);
+        }
+        for (int i = 0; i < n; i++) {
+            if (v[i].mode != MPC_FREE) continue;
+            float soc_term = v[i].soc + K_FACT * v[i].u - p->soc_ref;
+            float own = p->alpha * p->price + 2.0f * p->beta * v[i].u + 2.0f * p->gama * K_FACT * soc_term;
+            float u = v[i].u - step * (own + fleet_grad);
+            v[i].u = u > BAT_MAX_POWER_KW ? BAT_MAX_POWER_KW : (u < -BAT_MAX_POWER_KW ? -BAT_MAX_POWER_KW : u);
+        }
+    }
+}
+
+static int run_case(case_t c, int n, int clustered, int verbose) {
+    mpc_var_t v[MC_MAX_BATTERIES], ref[MC_MAX_BATTERIES];
+    mpc_params_t p;
+    mpc_pv_t pv, ref_pv;
+
+    setup(c, n, ref, &p, &ref_pv);
+    reference(ref, n, &p, &ref_pv);
+    float ref_u = mpc_fleet_u(ref, NULL, n);
+
+    setup(c, n, v, &p, &pv);
+    float fleet[MC_CYCLES];
+    for (int k = 0; k < MC_CYCLES; k++) {
+        if (clustered) mpc_pgd_clustered(v, n, &p, &pv, PGD_ITERATIONS);
+        else mpc_pgd(v, n, &p, &pv, PGD_ITERATIONS);
+        fleet[k] = mpc_fleet_u(v, NULL, n);
+    }
+
+    float swing = 0.0f;
+    for (int k = MC_CYCLES - MC_SETTLE_CYCLES; k < MC_CYCLES; k++) {
+        float d = fabsf(fleet[k] - fleet[k - 1]);
+        if (d > swing) swing = d;
+    }
+    float err = fabsf(fleet[MC_CYCLES - 1] - ref_u);
+    // one bin only in the mixed case: the cluster solve is exact there
+    float tol = (clustered && c != CASE_MIXED ? MC_CLUSTER_TOL : MC_REF_TOL) * n;
+    int ok = isfinite(fleet[MC_CYCLES - 1]) && swing <= MC_SETTLE_TOL * n && err <= tol;
+
+    // the mixed case must really mix saturated and free members
+    if (c == CASE_MIXED && clustered) {
+        int sat = 0, open = 0;
+        for (int i = 0; i < n; i++) {
+            if (v[i].mode != MPC_FREE) continue;
+            if (fabsf(v[i].u) >= BAT_MAX_POWER_KW) sat++; else open++;
+        }
+        if (sat == 0 || open == 0) {
+            printf("mixed n=%d: %d saturated, %d free members, case not exercised\n", n, sat, open);
+            ok = 0;
+        }
+    }
+
+    if (verbose || !ok) {
+        printf("%-4s %-6s n=%2d %-9s fleet %8.2f kW  ref %8.2f kW  swing %6.3f  err %6.3f\n",
+               ok ? "ok" : "FAIL", case_name[c], n, clustered ? "clustered" : "full",
+               fleet[MC_CYCLES - 1], ref_u, swing, err);
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    static const int sizes[] = { 8, 16, 40 };
+    int verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+    int total = 0, failed = 0;
+
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int c = 0; c < CASE_COUNT; c++) {
+            for (int clustered = 0; clustered <= 1; clustered++) {
+                total++;
+                if (!run_case((case_t)c, sizes[s], clustered, verbose)) failed++;
+            }
+        }
+    }
+    printf("%d/%d cases converged\n", total - failed, total);
+    return failed ? 1 : 0;
+}
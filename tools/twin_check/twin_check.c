@@ -0,0 +1,43 @@
+/*
+ * Reference side of the twin check: one battery_derate_power() +
+ * battery_physics_step() with zero noise over a fixed grid of states and
+ * setpoints, printed one case per line as
+ *
+ *   soc temp soh power_w  soc' temp'
+ *
+ * twin_check.py runs the same cases through RCA/battery_twin.py and
+ * compares the results.
+ */
+
+#include <stdio.h>
+
+#include "constants.h"
+#include "battery_physics.h"
+
+static const float grid_soc[] = { 0.01f, 0.05f, 0.5f, 0.95f, 0.99f };
+static const float grid_temp[] = { 25.0f, 45.0f, 79.9f };
+static const float grid_soh[] = { 1.0f, 0.8f };
+// +-15 kW supera il limite di corrente MAX_C_RATE
+static const float grid_power[] = { -15000.0f, -10000.0f, -3000.0f, 0.0f,
+                                    3000.0f, 10000.0f, 15000.0f };
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+int main(void) {
+    static const float noise[PHYS_NOISE_COUNT] = { 0.0f };
+    unsigned i, j, k, l;
+
+    for(i = 0; i < LEN(grid_soc); i++)
+    for(j = 0; j < LEN(grid_temp); j++)
+    for(k = 0; k < LEN(grid_soh); k++)
+    for(l = 0; l < LEN(grid_power); l++) {
+        battery_phys_t b = BATTERY_PHYS_INIT;
+        b.soc = grid_soc[i];
+        b.temp = grid_temp[j];
+        b.soh = grid_soh[k];
+        battery_physics_step(&b, battery_derate_power(b.soc, grid_power[l]), noise);
+        printf("%.9g %.9g %.9g %.9g %.9g %.9g\n", grid_soc[i], grid_temp[j],
+               grid_soh[k], grid_power[l], b.soc, b.temp);
+    }
+    return 0;
+}
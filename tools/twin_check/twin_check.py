@@ -0,0 +1,45 @@
+"""
+Twin side of the twin check: reads the cases printed by twin_check, runs
+them through RCA/battery_twin.py (constants parsed from battery_physics.h,
+as the RCA does at startup) and compares SoC and temperature.
+
+    ./twin_check | python3 twin_check.py
+
+Exits with status 1 on any mismatch.
+"""
+
+import os
+import sys
+
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "RCA"))
+import battery_twin  # noqa: E402
+
+SOC_TOL = 1e-5      # float32 del nodo contro float64 del gemello
+TEMP_TOL_C = 1e-3
+
+
+def main() -> int:
+    rows = np.loadtxt(sys.stdin, ndmin=2)
+    if rows.shape[0] == 0:
+        print("twin_check: nessun caso in ingresso")
+        return 1
+    soc, temp, soh, power_w, ref_soc, ref_temp = rows.T
+
+    k = battery_twin.load_constants()
+    p = battery_twin.derate_power(k, soc, power_w)
+    twin_soc, twin_temp = battery_twin.physics_step(k, soc, temp, soh, p, 1.0)
+
+    bad = (np.abs(twin_soc - ref_soc) > SOC_TOL) | (np.abs(twin_temp - ref_temp) > TEMP_TOL_C)
+    for i in np.flatnonzero(bad):
+        print(f"MISMATCH soc={soc[i]:g} temp={temp[i]:g} soh={soh[i]:g} p={power_w[i]:g}: "
+              f"node ({ref_soc[i]:.6f}, {ref_temp[i]:.4f}) twin ({twin_soc[i]:.6f}, {twin_temp[i]:.4f})")
+    print(f"twin_check: {rows.shape[0] - bad.sum()}/{rows.shape[0]} casi concordi "
+          f"(max |dSoC| {np.abs(twin_soc - ref_soc).max():.2e}, "
+          f"max |dT| {np.abs(twin_temp - ref_temp).max():.2e})")
+    return 1 if bad.any() else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
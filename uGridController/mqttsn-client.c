@@ -0,0 +1,51 @@
+#include "contiki.h"
+#include "net/ipv6/simple-udp.h"
+#include "net/ipv6/uiplib.h"
+#include "sys/log.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../includes/mqttsn.h"
+#include "../includes/project-conf.h"
+
+#define LOG_MODULE "mqttsn"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+#ifndef MQTTSN_GW_ADDR
+#define MQTTSN_GW_ADDR  "fd00::1"
+#endif
+#ifndef MQTTSN_GW_PORT
+#define MQTTSN_GW_PORT  MQTTSN_DEFAULT_PORT
+#endif
+
+static struct simple_udp_connection conn;
+static uip_ipaddr_t gw_addr;
+static bool ready = false;
+static uint8_t out[MQTTSN_PUBLISH_HDR_MAX + MQTTSN_MAX_DATA];
+
+void
+mqttsn_init(void)
+{
+    if(!uiplib_ipaddrconv(MQTTSN_GW_ADDR, &gw_addr)) {
+        LOG_ERR("[MQTTSN] Bad gateway address %s\n", MQTTSN_GW_ADDR);
+        return;
+    }
+    // publish only: no receive callback, the gateway never answers QoS -1
+    simple_udp_register(&conn, 0, NULL, MQTTSN_GW_PORT, NULL);
+    ready = true;
+    LOG_INFO("[MQTTSN] Publishing to [%s]:%u\n", MQTTSN_GW_ADDR, MQTTSN_GW_PORT);
+}
+
+int
+mqttsn_publish(uint16_t topic_id, const uint8_t *data, uint16_t data_len)
+{
+    if(!ready || data_len > MQTTSN_MAX_DATA) return -1;
+
+    int hdr = mqttsn_publish_header(out, topic_id, data_len);
+    if(hdr == 0) return -1;
+    memcpy(out + hdr, data, data_len);
+
+    simple_udp_sendto(&conn, out, (uint16_t)(hdr + data_len), &gw_addr);
+    return 0;
+}
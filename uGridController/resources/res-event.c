@@ -0,0 +1,114 @@
+#include "contiki.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "coap-engine.h"
+#include "coap.h"
+#include "cbor.h"
+#include "../../includes/constants.h"
+#include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
+#include "sys/log.h"
+
+#define LOG_MODULE "event"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+/* programmi di servizi ancillari: al massimo 15 minuti per evento */
+#define EVENT_MAX_SEC 900
+
+extern grid_event_t grid_event;
+PROCESS_NAME(ugrid_event);
+
+/*
+ * GET: grid event status
+ * { 0: active, 1: requested [cKW], 2: dispatched [cKW], 3: seconds left,
+ *   4: last request-to-dispatch latency [ms], 5: events served }
+ */
+static void
+res_event_get_handler(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    cbor_writer_state_t ws;
+    cbor_init_writer(&ws, buf, size);
+
+    uint32_t now = clock_seconds();
+    uint32_t left = (grid_event.active && grid_event.expiry > now) ? grid_event.expiry - now : 0;
+
+    cbor_open_map(&ws);
+    cbor_write_unsigned(&ws, 0); cbor_write_unsigned(&ws, grid_event.active ? 1 : 0);
+    cbor_write_unsigned(&ws, 1); cbor_write_signed(&ws, (int64_t)lroundf(grid_event.requested_kw * 100.0f));
+    cbor_write_unsigned(&ws, 2); cbor_write_signed(&ws, (int64_t)lroundf(grid_event.delta_kw * 100.0f));
+    cbor_write_unsigned(&ws, 3); cbor_write_unsigned(&ws, (uint64_t)left);
+    cbor_write_unsigned(&ws, 4); cbor_write_unsigned(&ws, (uint64_t)grid_event.last_ms);
+    cbor_write_unsigned(&ws, 5); cbor_write_unsigned(&ws, (uint64_t)grid_event.count);
+    cbor_close_map(&ws);
+
+    const size_t out_len = cbor_end_writer(&ws);
+    if(out_len == 0) {
+        coap_set_status_code(res, INTERNAL_SERVER_ERROR_5_00);
+        return;
+    }
+
+    coap_stats_rx(STATS_RES_CTRL, 0);
+    coap_stats_tx(STATS_RES_CTRL, (int)out_len);
+
+    coap_set_header_content_format(res, APPLICATION_CBOR);
+    coap_set_payload(res, buf, (uint16_t)out_len);
+}
+
+/*
+ * PUT {"kw":<cKW>,"s":<duration s>}: fleet power delta on top of the
+ * current dispatch (> 0 absorb, < 0 inject). s=0 cancels the event.
+ * The dispatch itself runs in the ugrid_event process, polled from here.
+ */
+static void
+res_event_put_handler(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    const uint8_t *payload;
+    int plen = coap_get_payload(req, &payload);
+    coap_stats_rx(STATS_RES_CTRL, plen);
+
+    static char s[48];
+    if(plen <= 0 || plen >= (int)sizeof(s)) {
+        coap_set_status_code(res, BAD_REQUEST_4_00);
+        return;
+    }
+    memcpy(s, payload, plen);
+    s[plen] = '\0';
+
+    int kw = 0, dur = 0;
+    if(sscanf(s, "{\"kw\":%d,\"s\":%d}", &kw, &dur) != 2 || dur < 0) {
+        LOG_WARN("[EVENT] Bad payload: %s\n", s);
+        coap_set_status_code(res, BAD_REQUEST_4_00);
+        return;
+    }
+
+    if(dur == 0) {
+        if(grid_event.active) {
+            grid_event.active = false;
+            process_poll(&ugrid_event);
+        }
+        coap_set_status_code(res, CHANGED_2_04);
+        return;
+    }
+    if(dur > EVENT_MAX_SEC) dur = EVENT_MAX_SEC;
+
+    grid_event.t_rx = clock_time();
+    grid_event.requested_kw = (float)kw / 100.0f;
+    grid_event.duration = (uint16_t)dur;
+    grid_event.expiry = clock_seconds() + dur;
+    grid_event.active = true;
+    grid_event.count++;
+    process_poll(&ugrid_event);
+
+    coap_set_status_code(res, CHANGED_2_04);
+}
+RESOURCE(res_event,
+        "title=\"Grid event\"",
+        res_event_get_handler,
+        NULL,
+        res_event_put_handler,
+        NULL);
@@ -0,0 +1,110 @@
+#include "contiki.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "coap-engine.h"
+#include "coap.h"
+#include "cbor.h"
+#include "../../includes/constants.h"
+#include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
+#include "sys/log.h"
+
+#define LOG_MODULE "flex"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+#define COORD_MAX_TTL_SEC 60
+
+extern ugrid_flex_t flex;
+extern float coord_setpoint;
+extern uint32_t coord_expiry;
+
+/*
+ * GET: aggregate flexibility of this controller (same scaling as /dev/state)
+ * { 0: p_min [cKW], 1: p_max [cKW], 2: energy [cKWh], 3: n_active,
+ *   4: current coordinator setpoint [cKW], 5: seconds left (0 = none) }
+ */
+static void
+res_flex_get_handler(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    cbor_writer_state_t ws;
+    cbor_init_writer(&ws, buf, size);
+
+    uint32_t now = clock_seconds();
+    uint32_t left = (coord_expiry > now) ? coord_expiry - now : 0;
+
+    cbor_open_map(&ws);
+    cbor_write_unsigned(&ws, 0); cbor_write_signed(&ws, (int64_t)lroundf(flex.p_min * 100.0f));
+    cbor_write_unsigned(&ws, 1); cbor_write_signed(&ws, (int64_t)lroundf(flex.p_max * 100.0f));
+    cbor_write_unsigned(&ws, 2); cbor_write_signed(&ws, (int64_t)lroundf(flex.energy_kwh * 100.0f));
+    cbor_write_unsigned(&ws, 3); cbor_write_unsigned(&ws, (uint64_t)flex.n_active);
+    cbor_write_unsigned(&ws, 4); cbor_write_signed(&ws, (int64_t)lroundf(coord_setpoint * 100.0f));
+    cbor_write_unsigned(&ws, 5); cbor_write_unsigned(&ws, (uint64_t)left);
+    cbor_close_map(&ws);
+
+    const size_t out_len = cbor_end_writer(&ws);
+    if(out_len == 0) {
+        coap_set_status_code(res, INTERNAL_SERVER_ERROR_5_00);
+        return;
+    }
+
+    coap_stats_rx(STATS_RES_CTRL, 0);
+    coap_stats_tx(STATS_RES_CTRL, (int)out_len);
+
+    coap_set_header_content_format(res, APPLICATION_CBOR);
+    coap_set_payload(res, buf, (uint16_t)out_len);
+}
+
+/*
+ * PUT {"sp":<cKW>,"ttl":<s>}: fleet setpoint assigned by the coordinator.
+ * ttl=0 drops the setpoint and returns the controller to local MPC only.
+ */
+static void
+res_flex_put_handler(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    const uint8_t *payload;
+    int plen = coap_get_payload(req, &payload);
+    coap_stats_rx(STATS_RES_CTRL, plen);
+
+    static char s[64];
+    if(plen <= 0 || plen >= (int)sizeof(s)) {
+        coap_set_status_code(res, BAD_REQUEST_4_00);
+        return;
+    }
+    memcpy(s, payload, plen);
+    s[plen] = '\0';
+
+    int sp = 0, ttl = 0;
+    if(sscanf(s, "{\"sp\":%d,\"ttl\":%d}", &sp, &ttl) != 2) {
+        LOG_WARN("[FLEX] Bad payload: %s\n", s);
+        coap_set_status_code(res, BAD_REQUEST_4_00);
+        return;
+    }
+
+    if(ttl <= 0) {
+        coord_expiry = 0;
+        LOG_INFO("[FLEX] Coordinator setpoint cleared\n");
+        coap_set_status_code(res, CHANGED_2_04);
+        return;
+    }
+    if(ttl > COORD_MAX_TTL_SEC) ttl = COORD_MAX_TTL_SEC;
+
+    float sp_kw = (float)sp / 100.0f;
+    if(sp_kw > flex.p_max) sp_kw = flex.p_max;
+    if(sp_kw < flex.p_min) sp_kw = flex.p_min;
+
+    coord_setpoint = sp_kw;
+    coord_expiry = clock_seconds() + ttl;
+
+    LOG_INFO("[FLEX] Coordinator setpoint %d cKW for %d s\n", (int)lroundf(sp_kw * 100.0f), ttl);
+    coap_set_status_code(res, CHANGED_2_04);
+}
+RESOURCE(res_flex,
+        "title=\"Flexibility\"",
+        res_flex_get_handler,
+        NULL,
+        res_flex_put_handler,
+        NULL);
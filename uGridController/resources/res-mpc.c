@@ -6,6 +6,7 @@
 #include "coap.h"
 #include "../../includes/constants.h"
 #include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
 #include "sys/log.h"
 
 extern battery_node_t batteries[];
@@ -25,7 +26,7 @@ res_mpc_put_handler(coap_message_t *req, coap_message_t *res,
         uint8_t *buf, uint16_t size, int32_t *off)
 {
     const uint8_t *payload;
-    coap_get_payload(req, &payload);
+    coap_stats_rx(STATS_RES_CTRL, coap_get_payload(req, &payload));
 
     static int a,b,c,p;
 
@@ -5,6 +5,7 @@
 #include "coap.h"
 #include "../../includes/constants.h"
 #include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
 #include "sys/log.h"
 
 extern battery_node_t batteries[];
@@ -46,6 +47,9 @@ res_obj_get_handler(coap_message_t *req, coap_message_t *res,
 
     len += snprintf((char *)buf + len, size - len, "]}");
 
+    coap_stats_rx(STATS_RES_CTRL, 0);
+    coap_stats_tx(STATS_RES_CTRL, len);
+
     coap_set_header_content_format(res, APPLICATION_JSON);
     coap_set_payload(res, buf, len);
 }
@@ -55,6 +59,7 @@ void res_obj_put_handler(coap_message_t *req, coap_message_t *res,
 {
     const uint8_t *payload;
     int plen = coap_get_payload(req, &payload);
+    coap_stats_rx(STATS_RES_CTRL, plen);
 
     static char s[128];
     if(plen <= 0 || plen >= (int)sizeof(s)) {
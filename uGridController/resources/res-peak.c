@@ -0,0 +1,89 @@
+#include "contiki.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "coap-engine.h"
+#include "coap.h"
+#include "cbor.h"
+#include "../../includes/constants.h"
+#include "../../includes/coap_stats.h"
+#include "sys/log.h"
+
+#define LOG_MODULE "peak"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+extern bool peak_enabled;
+extern float peak_weight;
+extern float billing_peak;
+
+/*
+ * GET: peak shaving status
+ * { 0: enabled, 1: weight [x100], 2: billing-period peak [cKW] }
+ */
+static void
+res_peak_get_handler(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    cbor_writer_state_t ws;
+    cbor_init_writer(&ws, buf, size);
+
+    cbor_open_map(&ws);
+    cbor_write_unsigned(&ws, 0); cbor_write_unsigned(&ws, peak_enabled ? 1 : 0);
+    cbor_write_unsigned(&ws, 1); cbor_write_unsigned(&ws, (uint64_t)lroundf(peak_weight * 100.0f));
+    cbor_write_unsigned(&ws, 2); cbor_write_signed(&ws, (int64_t)lroundf(billing_peak * 100.0f));
+    cbor_close_map(&ws);
+
+    const size_t out_len = cbor_end_writer(&ws);
+    if(out_len == 0) {
+        coap_set_status_code(res, INTERNAL_SERVER_ERROR_5_00);
+        return;
+    }
+
+    coap_stats_rx(STATS_RES_CTRL, 0);
+    coap_stats_tx(STATS_RES_CTRL, (int)out_len);
+
+    coap_set_header_content_format(res, APPLICATION_CBOR);
+    coap_set_payload(res, buf, (uint16_t)out_len);
+}
+
+/*
+ * PUT {"en":<0|1>,"w":<weight x100>}: enable/disable peak shaving
+ */
+static void
+res_peak_put_handler(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    const uint8_t *payload;
+    int plen = coap_get_payload(req, &payload);
+    coap_stats_rx(STATS_RES_CTRL, plen);
+
+    static char s[48];
+    if(plen <= 0 || plen >= (int)sizeof(s)) {
+        coap_set_status_code(res, BAD_REQUEST_4_00);
+        return;
+    }
+    memcpy(s, payload, plen);
+    s[plen] = '\0';
+
+    int en = 0, w = 0;
+    if(sscanf(s, "{\"en\":%d,\"w\":%d}", &en, &w) != 2 || w < 0) {
+        LOG_WARN("[PEAK] Bad payload: %s\n", s);
+        coap_set_status_code(res, BAD_REQUEST_4_00);
+        return;
+    }
+
+    peak_enabled = en != 0;
+    peak_weight = (float)w / 100.0f;
+
+    LOG_INFO("[PEAK] Peak shaving %s, weight x100=%d\n",
+             peak_enabled ? "ON" : "OFF", w);
+    coap_set_status_code(res, CHANGED_2_04);
+}
+RESOURCE(res_peak,
+        "title=\"Peak shaving\"",
+        res_peak_get_handler,
+        NULL,
+        res_peak_put_handler,
+        NULL);
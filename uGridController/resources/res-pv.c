@@ -0,0 +1,102 @@
+#include "contiki.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "coap-engine.h"
+#include "coap.h"
+#include "cbor.h"
+#include "../../includes/constants.h"
+#include "../../includes/coap_stats.h"
+#include "sys/log.h"
+
+#define LOG_MODULE "pv"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+extern float output[];
+extern float export_cap;
+extern float pv_limit;
+extern float pv_curtailed;
+
+/* cKW con -1 quando il limite non e' attivo */
+static int64_t
+ckw_or_off(float kw)
+{
+    return kw < 0.0f ? -1 : (int64_t)lroundf(kw * 100.0f);
+}
+
+/*
+ * GET: PV curtailment status
+ * { 0: forecast PV [cKW], 1: inverter limit [cKW|-1],
+ *   2: curtailed PV [cKW], 3: export cap [cKW|-1] }
+ */
+static void
+res_pv_get_handler(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    cbor_writer_state_t ws;
+    cbor_init_writer(&ws, buf, size);
+
+    cbor_open_map(&ws);
+    cbor_write_unsigned(&ws, 0); cbor_write_signed(&ws, (int64_t)lroundf(output[0] * 100.0f));
+    cbor_write_unsigned(&ws, 1); cbor_write_signed(&ws, ckw_or_off(pv_limit));
+    cbor_write_unsigned(&ws, 2); cbor_write_signed(&ws, (int64_t)lroundf(pv_curtailed * 100.0f));
+    cbor_write_unsigned(&ws, 3); cbor_write_signed(&ws, ckw_or_off(export_cap));
+    cbor_close_map(&ws);
+
+    const size_t out_len = cbor_end_writer(&ws);
+    if(out_len == 0) {
+        coap_set_status_code(res, INTERNAL_SERVER_ERROR_5_00);
+        return;
+    }
+
+    coap_stats_rx(STATS_RES_CTRL, 0);
+    coap_stats_tx(STATS_RES_CTRL, (int)out_len);
+
+    coap_set_header_content_format(res, APPLICATION_CBOR);
+    coap_set_payload(res, buf, (uint16_t)out_len);
+}
+
+/*
+ * PUT {"cap":<export cap cKW>}: a negative cap removes the limit,
+ * 0 makes the site zero-export
+ */
+static void
+res_pv_put_handler(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    const uint8_t *payload;
+    int plen = coap_get_payload(req, &payload);
+    coap_stats_rx(STATS_RES_CTRL, plen);
+
+    static char s[32];
+    if(plen <= 0 || plen >= (int)sizeof(s)) {
+        coap_set_status_code(res, BAD_REQUEST_4_00);
+        return;
+    }
+    memcpy(s, payload, plen);
+    s[plen] = '\0';
+
+    int cap = 0;
+    if(sscanf(s, "{\"cap\":%d}", &cap) != 1) {
+        LOG_WARN("[PV] Bad payload: %s\n", s);
+        coap_set_status_code(res, BAD_REQUEST_4_00);
+        return;
+    }
+
+    export_cap = cap < 0 ? -1.0f : (float)cap / 100.0f;
+
+    if(cap < 0) {
+        LOG_INFO("[PV] Export cap OFF\n");
+    } else {
+        LOG_INFO("[PV] Export cap %d cKW\n", cap);
+    }
+    coap_set_status_code(res, CHANGED_2_04);
+}
+RESOURCE(res_pv,
+        "title=\"PV curtailment\"",
+        res_pv_get_handler,
+        NULL,
+        res_pv_put_handler,
+        NULL);
@@ -6,6 +6,7 @@
 #include "net/ipv6/uiplib.h"
 #include "../../includes/constants.h"
 #include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
 #include "sys/log.h"
 
 extern battery_node_t batteries[];
@@ -17,6 +18,9 @@ extern int battery_count;
 PROCESS_NAME(ugrid_controller);
 
 static void res_reg_h(coap_message_t *req, coap_message_t *res, uint8_t *buf, uint16_t size, int32_t *off) {
+    const uint8_t *payload;
+    coap_stats_rx(STATS_RES_REGISTER, coap_get_payload(req, &payload));
+
     LOG_INFO(">>> [REGISTRY] Received registration from ");
     LOG_INFO_6ADDR(&req->src_ep->ipaddr);
     LOG_INFO_("\n");
@@ -35,6 +39,10 @@ static void res_reg_h(coap_message_t *req, coap_message_t *res, uint8_t *buf, ui
         batteries[battery_count].active = 1;
         batteries[battery_count].obs_requested = 0;
         batteries[battery_count].last_update_time = clock_seconds();
+        batteries[battery_count].last_obs_seq = UINT32_MAX;  /* observe seq is 24 bit */
+        batteries[battery_count].obs_retry_at = 0;
+        batteries[battery_count].obs_backoff = 0;
+        batteries[battery_count].obs_stale = false;
         batteries[battery_count].obs = NULL;
         batteries[battery_count].has_objective = false;
         batteries[battery_count].objective_power = 0.0f;
@@ -6,23 +6,28 @@
 #include <math.h>
 
 #include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
+#include "../../includes/env_model.h"
 
 extern int battery_count;
-extern float curr_load;
-extern float curr_pv;
+extern env_state_t env;
+extern float pv_curtailed;
 extern battery_node_t batteries[];
-
-    static void
-res_get_state_h(coap_message_t *req, coap_message_t *res,
-        uint8_t *buf, uint16_t size, int32_t *off)
+extern ugrid_flex_t flex;
+
+/*
+ * Stato compatto del uGrid in CBOR, condiviso da GET /dev/state e
+ * dall'uplink MQTT-SN. Ritorna 0 se il buffer non basta.
+ */
+size_t
+ugrid_state_encode(uint8_t *buf, uint16_t size)
 {
-    (void)req; (void)off;
-
     cbor_writer_state_t ws;
     cbor_init_writer(&ws, buf, size);
 
-    const int load_c = (int)lroundf(curr_load * 100.0f);
-    const int pv_c   = (int)lroundf(curr_pv   * 100.0f);
+    const int load_c = (int)lroundf(env.load * 100.0f);
+    /* FV effettivamente prodotto (dopo il limite dell'inverter) */
+    const int pv_c   = (int)lroundf((env.pv - pv_curtailed) * 100.0f);
 
     /* conta solo attive (coerente con bats[]) */
     int active_cnt = 0;
@@ -67,14 +72,39 @@ res_get_state_h(coap_message_t *req, coap_message_t *res,
     }
 
     cbor_close_array(&ws);
+
+    /* aggregato di flessibilità per il coordinatore: [p_min, p_max, energia] */
+    cbor_write_unsigned(&ws, 4);
+    cbor_open_array(&ws);
+    cbor_write_signed(&ws, (int64_t)lroundf(flex.p_min      * 100.0f));
+    cbor_write_signed(&ws, (int64_t)lroundf(flex.p_max      * 100.0f));
+    cbor_write_signed(&ws, (int64_t)lroundf(flex.energy_kwh * 100.0f));
+    cbor_close_array(&ws);
+
+    /* FV tagliato per rispettare il limite di export */
+    cbor_write_unsigned(&ws, 5);
+    cbor_write_signed(&ws, (int64_t)lroundf(pv_curtailed * 100.0f));
+
     cbor_close_map(&ws);
 
-    const size_t out_len = cbor_end_writer(&ws);
+    return cbor_end_writer(&ws);
+}
+
+    static void
+res_get_state_h(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    (void)req; (void)off;
+
+    const size_t out_len = ugrid_state_encode(buf, size);
     if(out_len == 0) {
         coap_set_status_code(res, INTERNAL_SERVER_ERROR_5_00);
         return;
     }
 
+    coap_stats_rx(STATS_RES_STATE, 0);
+    coap_stats_tx(STATS_RES_STATE, (int)out_len);
+
     coap_set_header_content_format(res, APPLICATION_CBOR);
     coap_set_payload(res, buf, (uint16_t)out_len);
 }
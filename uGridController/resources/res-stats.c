@@ -0,0 +1,52 @@
+#include "contiki.h"
+#include <stdint.h>
+#include "coap-engine.h"
+#include "coap.h"
+#include "cbor.h"
+#include "../../includes/utility.h"
+#include "../../includes/coap_stats.h"
+
+coap_stats_t coap_stats;
+
+extern cycle_stats_t cycle_stats;
+
+static void
+res_get_stats_h(coap_message_t *req, coap_message_t *res,
+        uint8_t *buf, uint16_t size, int32_t *off)
+{
+    (void)req; (void)off;
+
+    cbor_writer_state_t ws;
+    cbor_init_writer(&ws, buf, size);
+
+    cbor_open_map(&ws);
+    coap_stats_write_cbor(&ws);
+
+    /* 4: [cycles, overruns, skipped, late_starts, last_ms, max_ms, degrade] */
+    cbor_write_unsigned(&ws, 4);
+    cbor_open_array(&ws);
+    cbor_write_unsigned(&ws, cycle_stats.cycles);
+    cbor_write_unsigned(&ws, cycle_stats.overruns);
+    cbor_write_unsigned(&ws, cycle_stats.skipped);
+    cbor_write_unsigned(&ws, cycle_stats.late_starts);
+    cbor_write_unsigned(&ws, cycle_stats.last_ms);
+    cbor_write_unsigned(&ws, cycle_stats.max_ms);
+    cbor_write_unsigned(&ws, cycle_stats.degrade_level);
+    cbor_close_array(&ws);
+
+    cbor_close_map(&ws);
+
+    const size_t out_len = cbor_end_writer(&ws);
+    if(out_len == 0) {
+        coap_set_status_code(res, INTERNAL_SERVER_ERROR_5_00);
+        return;
+    }
+
+    coap_stats_rx(STATS_RES_STATS, 0);
+    coap_stats_tx(STATS_RES_STATS, (int)out_len);
+
+    coap_set_header_content_format(res, APPLICATION_CBOR);
+    coap_set_payload(res, buf, (uint16_t)out_len);
+}
+
+RESOURCE(res_stats, "title=\"Stats\"", res_get_stats_h, NULL, NULL, NULL);
@@ -18,7 +18,14 @@
 #include "../includes/constants.h"
 #include "../includes/utility.h"
 #include "../includes/power_predictor_model.h"
+#include "../includes/env_model.h"
+#include "../includes/mpc.h"
+#include "../includes/coap_stats.h"
+#include "../includes/trace.h"
 #include "../includes/project-conf.h"
+#if MQTTSN_CONF_ENABLED
+#include "../includes/mqttsn.h"
+#endif
 
 #define LOG_MODULE "uGrid"
 #define LOG_LEVEL LOG_LEVEL_INFO
@@ -32,40 +39,125 @@ float beta  = 1.0f;
 float gama  = 20.0f;
 float price = 0.25f;
 
-#define FREQ_COMPUTING  CLOCK_SECOND * 5
-#define K_FACT          0.05f
-#define SOC_REF         0.5f
-#define LEARNING_RATE   0.1f
-#define PGD_ITERATIONS  100
+/* Modalità gerarchica: aggregato esportato al coordinatore e setpoint
+ * di flotta ricevuto via /ctrl/flex (valido fino a coord_expiry) */
+ugrid_flex_t flex;
+float coord_setpoint = 0.0f;
+uint32_t coord_expiry = 0;
+
+/* Peak shaving (demand charge): il picco di import del periodo di
+ * fatturazione diventa un limite da difendere nel PGD; prima della fascia
+ * serale ad alta domanda il target di SoC sale per riservare energia.
+ * Configurabile via /ctrl/peak */
+#define PEAK_BILLING_CYCLES  (30 * 48)  /* 30 giorni simulati da 30 min */
+#define PEAK_FLOOR_KW        3.0f       /* sotto questo il picco non si difende */
+#define PEAK_RESERVE_SOC     0.8f
+#define PEAK_RESERVE_FROM_H  12.0f      /* ricarica dal FV di mezzogiorno... */
+#define PEAK_WINDOW_FROM_H   17.0f      /* ...per la fascia 17-21 */
+/* Limite di export e curtailment FV: il PGD pianifica quanta potenza FV
+ * tagliare (pv_curtail, sulle previsioni); il limite vero all'inverter
+ * simulato (pv_limit) si ricava dal carico misurato e dai comandi batteria.
+ * export_cap < 0 = nessun limite; 0 = sito a immissione zero. /ctrl/pv */
+float export_cap = -1.0f;
+float pv_curtail = 0.0f;     /* kW da tagliare pianificati dal solver */
+float pv_limit = -1.0f;      /* limite di potenza attiva all'inverter, < 0 = libero */
+float pv_curtailed = 0.0f;   /* kW effettivamente tagliati nel ciclo */
+
+/* Evento di rete (buco di frequenza, demand response) via /ctrl/event:
+ * ripartizione proporzionale sull'headroom in cache, inviata subito in NON
+ * dal processo ugrid_event senza aspettare il ciclo MPC; alla scadenza la
+ * flotta torna all'MPC */
+grid_event_t grid_event;
+
+bool  peak_enabled = false;
+float peak_weight = 0.5f;
+float billing_peak = 0.0f;
+uint16_t billing_cycle = 0;
+
+#define FREQ_COMPUTING  (CLOCK_SECOND * 5)
+
+/* Deadline del ciclo di controllo: oltre DEADLINE_HIGH_PCT del periodo si
+ * degrada (meno iterazioni PGD, niente log di stato), sotto DEADLINE_LOW_PCT
+ * per DEADLINE_RECOVER_CYCLES cicli consecutivi si risale di un livello */
+#define DEADLINE_HIGH_PCT       80
+#define DEADLINE_LOW_PCT        50
+#define DEADLINE_RECOVER_CYCLES 6
+#define DEGRADE_MAX_LEVEL       2
+
+/* Salute delle relazioni observe: una batteria notifica ogni 5 s, dopo
+ * OBS_STALE_SEC senza notifiche la relazione e' considerata morta e viene
+ * ri-registrata con backoff esponenziale e jitter */
+#define OBS_STALE_SEC        15
+#define OBS_BACKOFF_BASE_SEC 2
+#define OBS_BACKOFF_MAX_SEC  60
+
+cycle_stats_t cycle_stats;
+static uint8_t recover_count = 0;
+#define COORD_WEIGHT    0.5f   /* peso tracking setpoint coordinatore */
+
+/* Oltre questa flotta il PGD gira su batterie virtuali (cluster SoC/SoH),
+ * vedi mpc_pgd_clustered() */
+#ifndef MPC_CLUSTER_FROM
+#define MPC_CLUSTER_FROM 8
+#endif
 
-#define ML_PRED_WINDOW 10
-#define N_PRED_FEAT 6 
 float input_features[ML_PRED_WINDOW * N_PRED_FEAT];
 // this array contains:
 // - predicted future PV power
 // - predicted future load power
 float output[2];
 
-float curr_load = 2.0f;
-float curr_pv = 0.0f;
-float curr_hour = 6.0f;
-int16_t temp_raw = 0;
-float curr_temp = 22.0f;
-float curr_day = 0.5f; // day of week normalized
-float cloud_cover = 0.3f;
-bool is_sunny_day = true;
-float base_load = 2.0f;
-bool high_demand_period = false;
+// simulated site (PV, load), see includes/env_model.h
+env_state_t env = ENV_STATE_INIT;
 
 extern coap_resource_t 
     res_obj_ctrl,
     res_ugrid_state, 
     res_mpc_params,
-    res_register;
+    res_register,
+    res_flex,
+    res_peak,
+    res_pv,
+    res_event,
+    res_stats;
 
 static struct etimer et_compute;
 
+#if MQTTSN_CONF_ENABLED
+/* Uplink dello stato (stesso CBOR di /dev/state) dopo ogni ciclo: il cloud
+ * lo riceve dal broker invece di interrogare ogni sito via border router */
+extern size_t ugrid_state_encode(uint8_t *buf, uint16_t size);
+static uint8_t mqttsn_buf[MQTTSN_MAX_DATA];
+
+static void publish_state(void) {
+    size_t len = ugrid_state_encode(mqttsn_buf, sizeof(mqttsn_buf));
+    if (len == 0 || mqttsn_publish(MQTTSN_TOPIC_STATE, mqttsn_buf, (uint16_t)len) != 0) {
+        LOG_WARN("[MQTTSN] State not published (%u bytes)\n", (unsigned)len);
+    }
+}
+#endif
+
+// trace spans (native builds with TRACE=1, see includes/trace.h)
+static trace_ts_t span_cycle, span_env, span_infer, span_pgd, span_dispatch, span_notify;
+
 PROCESS_NAME(ugrid_controller);
+PROCESS_NAME(ugrid_event);
+
+static inline bool battery_dispatchable(int i) {
+    return batteries[i].active && batteries[i].state != STATE_ISOLATED;
+}
+
+// command of the control cycle: RCA objective or MPC optimum [kW]
+static float battery_base_kw(int i) {
+    return batteries[i].has_objective
+        ? batteries[i].objective_power
+        : batteries[i].optimal_u;
+}
+
+// command currently owed to a battery, a grid event overrides the cycle
+static float battery_cmd_kw(int i) {
+    return grid_event.active ? batteries[i].event_u : battery_base_kw(i);
+}
 
 // battery status print
 static void print_battery_status(void) {
@@ -124,116 +216,84 @@ static void print_battery_status(void) {
 }
 
 static void update_env() {
-    curr_hour += 0.5f; 
-    if(curr_hour >= 24.0f) {
-        curr_hour = 0.0f;
-        is_sunny_day = (random_rand() % 100) > 30;
-        curr_day += 0.1f;
-        if (curr_day > 1.0f) {
-            curr_day = 0.0f;
-        }
-    }
+    TRACE_BEGIN(span_env);
+    env_step(&env, random_rand);
 
-    // prediction 
-    float base_irradiance_for_ml = 0.0f;
+    // update ML buffer
+    env_push_features(&env, input_features);
+
+    LOG_INFO("==================CURRENT STATUS==============\n");
+    LOG_INFO("Current Load:\t%d.%d kW\n", (int)env.load, abs((int)(env.load * 100.0f) % 100));
+    LOG_INFO("Current PV:  \t%d.%d kW\n", (int)env.pv, abs((int)(env.pv * 100.0f) % 100));
 
-    // model to simulate irradiance and pv
-    if (curr_hour >= 6.0f && curr_hour < 18.0f) {
-        float sun_elevation = sin(3.14159f * (curr_hour - 6.0f) / 12.0f);
-        base_irradiance_for_ml = 1000.0f * sun_elevation;
+    float net_power = env.pv - env.load;
+    LOG_INFO("Net Power:   \t%s%d.%d kW%s\n", net_power > 10e-2 ? VERDE : ROSSO, (int)net_power, abs((int)(net_power * 100.0f) % 100), RESET);
+    TRACE_END(span_env, "update_env");
+}
 
-        cloud_cover += ((random_rand() % 100) / 50.0f - 1.0f) * 0.15f;
-        if(cloud_cover < 0.0f) cloud_cover = 0.0f;
-        if(cloud_cover > 0.95f) cloud_cover = 0.95f;
+// aggregate min/max power and stored energy of this controller's batteries,
+// computed once per cycle so the coordinator reads a constant-size summary
+static void update_flex() {
+    flex.p_min = 0.0f;
+    flex.p_max = 0.0f;
+    flex.energy_kwh = 0.0f;
+    flex.n_active = 0;
 
-        if(!is_sunny_day) {
-            cloud_cover = 0.5f + (cloud_cover * 0.5f);
+    for (int i = 0; i < battery_count; i++) {
+        batteries[i].head_up = 0.0f;
+        batteries[i].head_down = 0.0f;
+        if (!battery_dispatchable(i)) continue;
+
+        float soc = batteries[i].current_soc;
+        float base = battery_base_kw(i);
+        if (soc < 0.98f) {
+            flex.p_max += BAT_MAX_POWER_KW;
+            batteries[i].head_up = BAT_MAX_POWER_KW - base;
         }
-
-        float cloud_factor = 1.0f - (cloud_cover * 0.85f);
-        float turbulence = 1.0f;
-        if(cloud_cover > 0.3f) {
-            turbulence = 0.7f + ((random_rand() % 100) / 100.0f * 0.6f);
+        if (soc > 0.02f) {
+            flex.p_min -= BAT_MAX_POWER_KW;
+            batteries[i].head_down = base + BAT_MAX_POWER_KW;
         }
-
-        float effective_irradiance = base_irradiance_for_ml * cloud_factor * turbulence;
-        float pv_peak = BAT_MAX_POWER_KW;
-
-        curr_pv = (pv_peak * effective_irradiance / 1000.0f);
-        curr_pv += ((random_rand() % 100) / 100.0f - 0.5f) * 0.3f;
-
-        if(curr_pv < 0.0f) curr_pv = 0.0f;
-        if(curr_pv > pv_peak) curr_pv = pv_peak;
-    } else {
-        curr_pv = 0.0f;
-        cloud_cover = 0.3f;
+        if (batteries[i].head_up < 0.0f) batteries[i].head_up = 0.0f;
+        if (batteries[i].head_down < 0.0f) batteries[i].head_down = 0.0f;
+        flex.energy_kwh += soc * batteries[i].current_soh * BAT_CAPACITY_KWH;
+        flex.n_active++;
     }
+}
 
-
-    float hour_factor = 1.0f;
-
-    // model to simulate load
-    if(curr_hour >= 0.0f && curr_hour < 6.0f) {
-        hour_factor = 0.3f + ((random_rand() % 20) / 100.0f);
-        high_demand_period = false;
-    } 
-    else if(curr_hour >= 6.0f && curr_hour < 9.0f) {
-        float morning_ramp = (curr_hour - 6.0f) / 3.0f;
-        hour_factor = 0.5f + (morning_ramp * 0.7f);
-        high_demand_period = (curr_hour >= 7.0f && curr_hour <= 8.5f);
-    }
-    else if(curr_hour >= 9.0f && curr_hour < 12.0f) {
-        hour_factor = 0.9f + ((random_rand() % 30) / 100.0f);
-        high_demand_period = false;
-    }
-    else if(curr_hour >= 12.0f && curr_hour < 14.0f) {
-        hour_factor = 1.1f + ((random_rand() % 20) / 100.0f);
-        high_demand_period = true;
-    }
-    else if(curr_hour >= 14.0f && curr_hour < 17.0f) {
-        hour_factor = 0.7f + ((random_rand() % 30) / 100.0f);
-        high_demand_period = false;
-    }
-    else if(curr_hour >= 17.0f && curr_hour < 21.0f) {
-        hour_factor = 1.3f + ((random_rand() % 40) / 100.0f);
-        high_demand_period = true;
+// inverter stand-in: hard export cap from the measured load and the
+// commands owed to the batteries, grid = load - pv + sum(cmd) >= -cap.
+// The forecast only enters through the commands (pv_curtail is the plan),
+// so a forecast miss cannot push the export past the cap.
+static void apply_pv_limit(void) {
+    if (export_cap < 0.0f) {
+        pv_limit = -1.0f;
+        pv_curtailed = 0.0f;
+        return;
     }
-    else {
-        float evening_ramp = 1.0f - ((curr_hour - 21.0f) / 3.0f);
-        hour_factor = 0.4f + (evening_ramp * 0.6f);
-        high_demand_period = false;
+    float cmd_kw = 0.0f;
+    for (int i = 0; i < battery_count; i++) {
+        if (battery_dispatchable(i)) cmd_kw += battery_cmd_kw(i);
     }
+    pv_limit = env.load + cmd_kw + export_cap;
+    if (pv_limit < 0.0f) pv_limit = 0.0f;
+    pv_curtailed = env.pv > pv_limit ? env.pv - pv_limit : 0.0f;
+}
 
-    float event_load = 0.0f;
-    if((random_rand() % 100) < 15) {
-        event_load = ((random_rand() % 30) / 10.0f) + 1.0f;
+// running import peak over the billing period (cycle-counted)
+static void update_billing_peak(float grid_kw) {
+    if (++billing_cycle >= PEAK_BILLING_CYCLES) {
+        billing_cycle = 0;
+        billing_peak = 0.0f;
+        LOG_INFO("[PEAK] New billing period\n");
     }
-
-    base_load = 2.5f;
-    curr_load = (base_load * hour_factor) + event_load;
-    curr_load += ((random_rand() % 100) / 100.0f - 0.5f) * 0.4f;
-
-    if(curr_load < 0.5f) curr_load = 0.5f; 
-    if(curr_load > BAT_MAX_POWER_KW * 0.8f) curr_load = BAT_MAX_POWER_KW * 0.8f;
-
-    // update ML buffer
-    for (int i=0; i<(ML_PRED_WINDOW-1)*N_PRED_FEAT; i++) {
-        input_features[i] = input_features[i+N_PRED_FEAT];
+    if (grid_kw > billing_peak) {
+        billing_peak = grid_kw;
+        if (peak_enabled) {
+            LOG_INFO("[PEAK] New billing peak: %d.%02d kW\n",
+                     (int)billing_peak, abs((int)(billing_peak * 100.0f)) % 100);
+        }
     }
-
-    int idx = (ML_PRED_WINDOW-1)*N_PRED_FEAT;
-    input_features[idx] = (base_irradiance_for_ml / MAX_IRR); 
-    input_features[idx+1] = curr_temp; // resolution of 0.25oC
-    input_features[idx+2] = curr_hour/24.0f; // hour normalized
-    input_features[idx+3] = curr_day; 
-    input_features[idx+4] = curr_pv/BAT_MAX_POWER_KW;
-    input_features[idx+5] = curr_load/BAT_MAX_POWER_KW;
-    LOG_INFO("==================CURRENT STATUS==============\n");
-    LOG_INFO("Current Load:\t%d.%d kW\n", (int)curr_load, abs((int)(curr_load * 100.0f) % 100));
-    LOG_INFO("Current PV:  \t%d.%d kW\n", (int)curr_pv, abs((int)(curr_pv * 100.0f) % 100));
-
-    float net_power = curr_pv - curr_load;
-    LOG_INFO("Net Power:   \t%s%d.%d kW%s\n", net_power > 10e-2 ? VERDE : ROSSO, (int)net_power, abs((int)(net_power * 100.0f) % 100), RESET);
 }
 
 static void run_mpc() {
@@ -242,7 +302,9 @@ static void run_mpc() {
     LOG_INFO("================MPC OPTIMIZATION==============\n");
 
     // compute predicted PV and load power
+    TRACE_BEGIN(span_infer);
     power_predictor_regress(input_features, ML_PRED_WINDOW * N_PRED_FEAT, output, 2);
+    TRACE_END(span_infer, "inference");
     
     // clamp values 
     if ( output[0] < 0 ) {
@@ -273,34 +335,65 @@ static void run_mpc() {
             (int)avg_soc_pct, abs((int)(avg_soc_pct*100.0f))%100);
 
 
+    // in hierarchical mode the coordinator assigns a fleet setpoint:
+    // a quadratic coupling term pulls the sum of commands towards it
+    bool coord_active = coord_expiry != 0 && clock_seconds() < coord_expiry;
+
     // lightweight projected gradient algorithm:
     // mathematical tractation in chapter 2.3.2 of documentation
     // stop condition: static number of iteration
-    for (int iter = 0; iter < PGD_ITERATIONS; iter++) {
-        
-        for (int i = 0; i < battery_count; i++) {
-            
-            // consider only active batteries
-            if (!batteries[i].active) continue;
-            
-            // consider only non isolated batteries
-            if (batteries[i].state == STATE_ISOLATED) continue;
-            
-            // consider only batteries that do not actually have an objective set
-            if (batteries[i].has_objective) continue;
-
-            float u = batteries[i].optimal_u;
-            float soc_term = batteries[i].current_soc + (K_FACT * u) - SOC_REF;
-            float grad = (alpha * price) + (2.0f * beta  * u) + (2.0f * gama * K_FACT * soc_term);
-
-            u = u - (LEARNING_RATE * grad);
-            if (u > BAT_MAX_POWER_KW)  u = BAT_MAX_POWER_KW;
-            if (u < -BAT_MAX_POWER_KW) u = -BAT_MAX_POWER_KW;
-
-            batteries[i].optimal_u = u;
+    // degraded cycles run a truncated PGD (warm-started from last optimum)
+    int pgd_iterations = PGD_ITERATIONS >> cycle_stats.degrade_level;
+
+    mpc_var_t vars[MAX_BATTERIES];
+    for (int i = 0; i < battery_count; i++) {
+        vars[i].soc = batteries[i].current_soc;
+        vars[i].soh = batteries[i].current_soh;
+        vars[i].u = batteries[i].optimal_u;
+        vars[i].fixed_u = batteries[i].objective_power;
+        if (!battery_dispatchable(i)) {
+            vars[i].mode = MPC_OFF;
+        } else if (grid_event.active) {
+            // the fleet terms must see what the batteries are really doing
+            vars[i].fixed_u = batteries[i].event_u;
+            vars[i].mode = MPC_FIXED;
+        } else {
+            vars[i].mode = batteries[i].has_objective ? MPC_FIXED : MPC_FREE;
+        }
+    }
+    mpc_params_t params = {
+        alpha, beta, gama, price, coord_active, coord_setpoint, COORD_WEIGHT,
+        SOC_REF, 0.0f, 0.0f, output[1] - output[0]
+    };
+
+    // peak shaving: defend the billing peak against the forecast net load
+    // and hold a reserve before the evening high-demand window
+    if (peak_enabled) {
+        params.peak_weight = peak_weight;
+        params.peak_limit = billing_peak > PEAK_FLOOR_KW ? billing_peak : PEAK_FLOOR_KW;
+        if (env.hour >= PEAK_RESERVE_FROM_H && env.hour < PEAK_WINDOW_FROM_H) {
+            params.soc_ref = PEAK_RESERVE_SOC;
         }
+    }
+
+    // curtailment is only a decision when an export cap is configured
+    mpc_pv_t pv = { output[0], export_cap, pv_curtail };
+
+    TRACE_BEGIN(span_pgd);
+    if (battery_count >= MPC_CLUSTER_FROM) {
+        int clusters = mpc_pgd_clustered(vars, battery_count, &params, &pv, pgd_iterations);
+        LOG_INFO("PGD on %d clusters for %d batteries\n", clusters, battery_count);
+    } else {
+        mpc_pgd(vars, battery_count, &params, &pv, pgd_iterations);
+    }
+    TRACE_END(span_pgd, "pgd");
+
+    pv_curtail = pv.curtail;
 
+    for (int i = 0; i < battery_count; i++) {
+        batteries[i].optimal_u = vars[i].u;
     }
+    apply_pv_limit();
     
     LOG_INFO("\n");
     LOG_INFO("===========OPTIMIZATION RESULTS===============\n");
@@ -311,9 +404,7 @@ static void run_mpc() {
         if (!batteries[i].active) continue;
 
 
-        float cmd_kw = batteries[i].has_objective
-            ? batteries[i].objective_power
-            : batteries[i].optimal_u;
+        float cmd_kw = battery_cmd_kw(i);
 
         total_command += cmd_kw;
 
@@ -332,10 +423,16 @@ static void run_mpc() {
                 cmd_int, cmd_dec,
                 RESET,
                 soc_int, soc_dec,
-                batteries[i].has_objective ? "OBJ" : "MPC");
+                grid_event.active ? "EVT" : batteries[i].has_objective ? "OBJ" : "MPC");
     }
 
-    float expected_grid = curr_load - curr_pv + total_command;
+    float expected_grid = env.load - (env.pv - pv_curtailed) + total_command;
+
+    if (pv_curtailed > 0.0f) {
+        LOG_INFO("PV curtailed:\t%d.%02d kW (limit %d.%02d kW)\n",
+                 (int)pv_curtailed, abs((int)(pv_curtailed * 100.0f)) % 100,
+                 (int)pv_limit, abs((int)(pv_limit * 100.0f)) % 100);
+    }
 
     LOG_INFO("Expected:%s\t\t%d.%d kW %s", expected_grid > 0 ? ROSSO : VERDE, (int)expected_grid, abs((int)(expected_grid * 100.0f)) %100, RESET);
     if(fabs(expected_grid) < 0.5f) {
@@ -346,6 +443,7 @@ static void run_mpc() {
         LOG_INFO_("(Export)\n");
     }
 
+    update_billing_peak(expected_grid);
 }
 
 
@@ -355,11 +453,25 @@ battery_notification_handler(coap_observee_t *obs,
 {
     if(!notification) {
         LOG_WARN("[OBSERVE] NULL notification (flag=%d)\n", flag);
+        if(flag == NO_REPLY_FROM_SERVER || flag == ERROR_RESPONSE_CODE ||
+           flag == OBSERVE_NOT_SUPPORTED) {
+            // relation is gone: let the health check re-register it
+            for(int i = 0; i < battery_count; i++) {
+                if(batteries[i].obs == obs) {
+                    batteries[i].obs = NULL;
+                    break;
+                }
+            }
+        }
         return;
     }
 
+    coap_message_t *msg = (coap_message_t *)notification;
+    coap_stats.notify_rcvd++;
+    TRACE_BEGIN(span_notify);
+
     const uint8_t *payload = NULL;
-    int len = coap_get_payload(notification, &payload);
+    int len = coap_get_payload(msg, &payload);
     if(len <= 0) return;
 
     static char s[128];
@@ -379,6 +491,16 @@ battery_notification_handler(coap_observee_t *obs,
 
     for(int i=0; i<battery_count; i++) {
         if(uip_ipaddr_cmp(&batteries[i].ip, &obs->endpoint.ipaddr)) {
+            if(msg->observe == batteries[i].last_obs_seq) {
+                coap_stats.notify_dup++;
+                break;
+            }
+            batteries[i].last_obs_seq = msg->observe;
+            if(batteries[i].obs_stale) {
+                LOG_INFO("[OBSERVE] Battery #%d notifications resumed\n", i);
+            }
+            batteries[i].obs_stale = false;
+            batteries[i].obs_backoff = 0;
             batteries[i].current_soc     = (float)soc / 10000.0f;
             batteries[i].current_voltage = (float)voltage / 100.0f;
             batteries[i].current_temp    = (float)temperature / 100.0f;
@@ -390,22 +512,234 @@ battery_notification_handler(coap_observee_t *obs,
             break;
         }
     }
+    TRACE_END(span_notify, "notification");
+}
+
+
+static uint32_t ticks_to_ms(clock_time_t t) {
+    return (uint32_t)(((uint64_t)t * 1000) / CLOCK_SECOND);
 }
 
+// account the cycle that just ended and re-arm the compute timer:
+// on overrun the missed periods are skipped (no back-to-back catch-up)
+static void end_cycle(clock_time_t cycle_start) {
+    clock_time_t elapsed = clock_time() - cycle_start;
+    uint32_t elapsed_ms = ticks_to_ms(elapsed);
+
+    cycle_stats.cycles++;
+    cycle_stats.last_ms = elapsed_ms;
+    if (elapsed_ms > cycle_stats.max_ms) cycle_stats.max_ms = elapsed_ms;
+
+    if (elapsed >= FREQ_COMPUTING) {
+        uint32_t missed = elapsed / FREQ_COMPUTING;
+        cycle_stats.overruns++;
+        cycle_stats.skipped += missed;
+        etimer_set(&et_compute, FREQ_COMPUTING - (elapsed % FREQ_COMPUTING));
+        LOG_WARN("[DEADLINE] Cycle took %lu ms, skipping %lu period(s)\n",
+                 (unsigned long)elapsed_ms, (unsigned long)missed);
+    } else {
+        etimer_reset(&et_compute);
+    }
+
+    if (elapsed * 100 >= (clock_time_t)FREQ_COMPUTING * DEADLINE_HIGH_PCT) {
+        recover_count = 0;
+        if (cycle_stats.degrade_level < DEGRADE_MAX_LEVEL) {
+            cycle_stats.degrade_level++;
+            LOG_WARN("[DEADLINE] Degrading to level %d\n", cycle_stats.degrade_level);
+        }
+    } else if (elapsed * 100 < (clock_time_t)FREQ_COMPUTING * DEADLINE_LOW_PCT) {
+        if (cycle_stats.degrade_level > 0 && ++recover_count >= DEADLINE_RECOVER_CYCLES) {
+            recover_count = 0;
+            cycle_stats.degrade_level--;
+            LOG_INFO("[DEADLINE] Recovering to level %d\n", cycle_stats.degrade_level);
+        }
+    } else {
+        recover_count = 0;
+    }
+}
+
+static void obs_register(int i) {
+    static coap_endpoint_t obs_ep;
+
+    memset(&obs_ep, 0, sizeof(obs_ep));
+    uip_ipaddr_copy(&obs_ep.ipaddr, &batteries[i].ip);
+    obs_ep.port = UIP_HTONS(COAP_DEFAULT_PORT);
+
+    LOG_INFO("[OBSERVE] Setting up observation for Battery #%d: ", i);
+    LOG_INFO_6ADDR(&batteries[i].ip);
+    LOG_INFO_("\n");
+
+    batteries[i].last_obs_seq = UINT32_MAX;
+    batteries[i].obs = coap_obs_request_registration(
+            &obs_ep, 
+            "dev/state", 
+            battery_notification_handler, 
+            NULL
+            );
+
+    if(batteries[i].obs != NULL) {
+        coap_stats.obs_reg_ok++;
+        LOG_INFO("[OBSERVE] ✓ Observation registered successfully for Battery #%d\n", i);
+    } else {
+        coap_stats.obs_reg_fail++;
+        LOG_WARN("[OBSERVE] ✗ Failed to register observation for Battery #%d\n", i);
+    }
+
+    batteries[i].obs_requested = true;
+}
+
+// re-register relations that failed or stopped delivering notifications,
+// spacing retries with jittered exponential backoff per battery
+static void obs_health_check(void) {
+    uint32_t now = clock_seconds();
+
+    for(int i = 0; i < battery_count; i++) {
+        if(!batteries[i].active || !batteries[i].obs_requested) continue;
+
+        bool silent = (now - batteries[i].last_update_time) > OBS_STALE_SEC;
+        if(batteries[i].obs != NULL && !silent) continue;
+
+        if(silent && !batteries[i].obs_stale) {
+            batteries[i].obs_stale = true;
+            coap_stats.obs_stale++;
+            LOG_WARN("[OBSERVE] Battery #%d stale: no notification for %lu s\n",
+                     i, (unsigned long)(now - batteries[i].last_update_time));
+        }
+        if(now < batteries[i].obs_retry_at) continue;
+
+        uint32_t delay = OBS_BACKOFF_BASE_SEC << batteries[i].obs_backoff;
+        if(delay > OBS_BACKOFF_MAX_SEC) {
+            delay = OBS_BACKOFF_MAX_SEC;
+        } else {
+            batteries[i].obs_backoff++;
+        }
+        delay += random_rand() % (delay / 2 + 1);
+        batteries[i].obs_retry_at = now + delay;
+
+        if(batteries[i].obs != NULL) {
+            coap_obs_remove_observee(batteries[i].obs);
+            batteries[i].obs = NULL;
+        }
+        coap_stats.obs_rereg++;
+        obs_register(i);
+    }
+}
 
 static void empty_cb(coap_message_t *response) {
-    (void)response;
-    /* Silent callback */
+    /* only outcome accounting */
+    coap_stats_response(response);
+}
+
+/* ---------------------------------------------------------------------- */
+/* grid events: proportional dispatch outside the control cycle            */
+/* ---------------------------------------------------------------------- */
+
+// split the event delta over the headroom cached by the last cycle
+static void event_compute(void) {
+    float room = 0.0f;
+    bool up = grid_event.requested_kw > 0.0f;
+
+    for (int i = 0; i < battery_count; i++) {
+        if (!battery_dispatchable(i)) continue;
+        room += up ? batteries[i].head_up : batteries[i].head_down;
+    }
+
+    float delta = grid_event.requested_kw;
+    if (delta > room)  delta = room;
+    if (delta < -room) delta = -room;
+    grid_event.delta_kw = delta;
+
+    for (int i = 0; i < battery_count; i++) {
+        float share = 0.0f;
+        if (battery_dispatchable(i) && room > 0.0f) {
+            share = (up ? batteries[i].head_up : batteries[i].head_down) / room;
+        }
+        batteries[i].event_u = battery_base_kw(i) + delta * share;
+    }
+}
+
+// fire-and-forget PUT: no blocking round trip per battery, the next
+// control cycle re-sends the same command confirmable anyway
+static void send_power_non(int i, float cmd_kw) {
+    static coap_message_t msg[1];
+    static uint8_t buf[64];
+    static char pl[32];
+    coap_endpoint_t ep;
+
+    memset(&ep, 0, sizeof(ep));
+    uip_ipaddr_copy(&ep.ipaddr, &batteries[i].ip);
+    ep.port = UIP_HTONS(COAP_DEFAULT_PORT);
+
+    coap_init_message(msg, COAP_TYPE_NON, COAP_PUT, coap_get_mid());
+    coap_set_header_uri_path(msg, "dev/power");
+    snprintf(pl, sizeof(pl), "{\"u\":%d}", (int)(cmd_kw * 1000));
+    coap_set_payload(msg, (uint8_t *)pl, strlen(pl));
+
+    size_t len = coap_serialize_message(msg, buf);
+    if (len == 0) return;
+
+    coap_sendto(&ep, buf, (uint16_t)len);
+    coap_stats.req_sent++;
+    coap_stats.res[STATS_RES_POWER].bytes_out += strlen(pl);
+}
+
+static void event_send(void) {
+    for (int i = 0; i < battery_count; i++) {
+        if (!battery_dispatchable(i)) continue;
+        send_power_non(i, battery_cmd_kw(i));
+    }
 }
 
 PROCESS(ugrid_controller, "uGrid");
+PROCESS(ugrid_event, "uGrid event");
 AUTOSTART_PROCESSES(&ugrid_controller);
 
+PROCESS_THREAD(ugrid_event, ev, data) {
+    static struct etimer et_event;
+
+    PROCESS_BEGIN();
+
+    while(1) {
+        PROCESS_WAIT_EVENT();
+
+        // polled by /ctrl/event on a new event or a cancel
+        if(ev == PROCESS_EVENT_POLL) {
+            if(grid_event.active) {
+                event_compute();
+                event_send();
+                apply_pv_limit();
+                etimer_set(&et_event, (clock_time_t)grid_event.duration * CLOCK_SECOND);
+
+                grid_event.last_ms = ticks_to_ms(clock_time() - grid_event.t_rx);
+                LOG_INFO("[EVENT] %d cKW asked, %d cKW dispatched in %lu ms for %u s\n",
+                         (int)lroundf(grid_event.requested_kw * 100.0f),
+                         (int)lroundf(grid_event.delta_kw * 100.0f),
+                         (unsigned long)grid_event.last_ms, grid_event.duration);
+            } else {
+                etimer_stop(&et_event);
+                event_send();
+                apply_pv_limit();
+                LOG_INFO("[EVENT] Cancelled, fleet back to MPC\n");
+            }
+        }
+
+        // expired: hand the fleet back to the last MPC / objective commands
+        if(ev == PROCESS_EVENT_TIMER && data == &et_event && grid_event.active) {
+            grid_event.active = false;
+            event_send();
+            apply_pv_limit();
+            LOG_INFO("[EVENT] Expired, fleet back to MPC\n");
+        }
+    }
+    PROCESS_END();
+}
+
 PROCESS_THREAD(ugrid_controller, ev, data) {
     static coap_endpoint_t ep;
     static coap_message_t req[1];
     static char pl[32];
     static int i; 
+    static clock_time_t cycle_start;
 
     PROCESS_BEGIN();
 
@@ -414,13 +748,24 @@ PROCESS_THREAD(ugrid_controller, ev, data) {
     printf("%p\n", eml_net_activation_function_strs);
 
     leds_on(LEDS_GREEN);
+    TRACE_INIT("uGrid");
 
     coap_activate_resource(&res_register, "dev/register");
     coap_activate_resource(&res_ugrid_state, "dev/state");
     coap_activate_resource(&res_mpc_params, "ctrl/mpc");
     coap_activate_resource(&res_obj_ctrl, "ctrl/obj");
+    coap_activate_resource(&res_flex, "ctrl/flex");
+    coap_activate_resource(&res_peak, "ctrl/peak");
+    coap_activate_resource(&res_pv, "ctrl/pv");
+    coap_activate_resource(&res_event, "ctrl/event");
+    coap_activate_resource(&res_stats, "dev/stats");
 
 
+    process_start(&ugrid_event, NULL);
+#if MQTTSN_CONF_ENABLED
+    mqttsn_init();
+#endif
+
     LOG_INFO("[INIT] CoAP resources activated\n");
     LOG_INFO("[INIT] Ready to accept battery registrations\n");
     LOG_INFO("\n");
@@ -431,14 +776,22 @@ PROCESS_THREAD(ugrid_controller, ev, data) {
         PROCESS_WAIT_EVENT();
 
         if(ev == PROCESS_EVENT_TIMER && data == &et_compute) {
+            cycle_start = clock_time();
+            if (cycle_start - etimer_expiration_time(&et_compute) > 1) {
+                cycle_stats.late_starts++;
+            }
             leds_on(LEDS_BLUE);
+            TRACE_BEGIN(span_cycle);
+            obs_health_check();
             update_env(); 
             run_mpc(); 
+            update_flex();
 
             LOG_INFO("\n");
             LOG_INFO("===========OPTIMIZATION RESULTS===============\n");
 
-            // send message to single clients
+            // send message to single clients (span crosses the blocking requests)
+            TRACE_BEGIN(span_dispatch);
             for(i = 0; i < battery_count; i++) {
                 if (!batteries[i].active) continue;
 
@@ -458,9 +811,7 @@ PROCESS_THREAD(ugrid_controller, ev, data) {
                 coap_init_message(req, COAP_TYPE_CON, COAP_PUT, 0);
                 coap_set_header_uri_path(req, "dev/power");
 
-                float cmd_kw = batteries[i].has_objective
-                    ? batteries[i].objective_power
-                    : batteries[i].optimal_u;
+                float cmd_kw = battery_cmd_kw(i);
 
                 int cmd_scaled = (int)(cmd_kw * 1000);
                 snprintf(pl, sizeof(pl), "{\"u\":%d}", cmd_scaled);
@@ -468,17 +819,29 @@ PROCESS_THREAD(ugrid_controller, ev, data) {
 
                 LOG_INFO("Battery #%d: [%s]: %s%d.%d kW%s\n",
                         i,
-                        batteries[i].has_objective ? "OBJ" : "MPC",
+                        grid_event.active ? "EVT" : batteries[i].has_objective ? "OBJ" : "MPC",
                         cmd_kw > 0 ? VERDE : ROSSO,
                         (int)(cmd_kw), abs((int)(cmd_kw * 100.0f)) % 100,
                         RESET );
 
+                coap_stats.req_sent++;
+                coap_stats.res[STATS_RES_POWER].bytes_out += strlen(pl);
                 COAP_BLOCKING_REQUEST(&ep, req, empty_cb);
             }
+            TRACE_END(span_dispatch, "dispatch");
 
-            print_battery_status();
+#if MQTTSN_CONF_ENABLED
+            publish_state();
+#endif
+
+            if (cycle_stats.degrade_level == 0) {
+                print_battery_status();
+            }
 
-            etimer_reset(&et_compute);
+            end_cycle(cycle_start);
+            TRACE_END(span_cycle, "cycle");
+            TRACE_COUNTER("degrade_level", cycle_stats.degrade_level);
+            TRACE_FLUSH();
             leds_off(LEDS_BLUE);
         }
 
@@ -487,28 +850,7 @@ PROCESS_THREAD(ugrid_controller, ev, data) {
 
             for(i = 0; i < battery_count; i++) {
                 if(batteries[i].active && !batteries[i].obs_requested) {
-                    memset(&ep, 0, sizeof(ep));
-                    uip_ipaddr_copy(&ep.ipaddr, &batteries[i].ip);
-                    ep.port = UIP_HTONS(COAP_DEFAULT_PORT);
-
-                    LOG_INFO("[OBSERVE] Setting up observation for Battery #%d: ", i);
-                    LOG_INFO_6ADDR(&batteries[i].ip);
-                    LOG_INFO_("\n");
-
-                    batteries[i].obs = coap_obs_request_registration(
-                            &ep, 
-                            "dev/state", 
-                            battery_notification_handler, 
-                            NULL
-                            );
-
-                    if(batteries[i].obs != NULL) {
-                        LOG_INFO("[OBSERVE] ✓ Observation registered successfully for Battery #%d\n", i);
-                    } else {
-                        LOG_WARN("[OBSERVE] ✗ Failed to register observation for Battery #%d\n", i);
-                    }
-
-                    batteries[i].obs_requested = true;
+                    obs_register(i);
                 }
             }
         }